@@ -0,0 +1,38 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <trieste/rewrite.h>
+
+#include <chrono>
+
+namespace bench
+{
+  using namespace trieste;
+
+  // The number of calls to the global operator new so far.
+  size_t allocations();
+
+  class Timer
+  {
+  private:
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    Timer() : start(std::chrono::steady_clock::now()) {}
+
+    double seconds() const
+    {
+      return std::chrono::duration<double>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+    }
+  };
+
+  void match(size_t n, size_t reps);
+  void lex(size_t size, size_t reps);
+  void source(size_t size, size_t reps);
+  void wide(size_t n);
+  void reuse(size_t refs, size_t size, bool lazy);
+  void reclaim(size_t n, size_t reps);
+}
@@ -0,0 +1,127 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <trieste/parse.h>
+
+namespace bench
+{
+  inline const auto Keyword = TokenDef("keyword");
+  inline const auto Ident = TokenDef("ident");
+  inline const auto Int = TokenDef("int");
+  inline const auto Float = TokenDef("float");
+  inline const auto String = TokenDef("string");
+  inline const auto Op = TokenDef("op");
+  inline const auto Paren = TokenDef("paren");
+  inline const auto Brace = TokenDef("brace");
+
+  // A lexer shaped like a small programming language: many fixed tokens that
+  // must be tried before the identifier rule, and modes for strings and block
+  // comments.
+  Parse lexer()
+  {
+    Parse p(depth::file);
+
+    p("start",
+      {
+        "[[:space:]]+" >> [](auto&) {},
+        "//[^\n]*" >> [](auto&) {},
+        R"(/\*)" >> [](auto& m) { m.mode("comment"); },
+        "\"" >> [](auto& m) { m.mode("string"); },
+        R"(\()" >> [](auto& m) { m.push(Paren); },
+        R"(\))" >> [](auto& m) { m.term(); m.pop(Paren); },
+        R"(\{)" >> [](auto& m) { m.push(Brace); },
+        R"(\})" >> [](auto& m) { m.term(); m.pop(Brace); },
+        ";" >> [](auto& m) { m.term(); },
+        R"(if\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(else\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(while\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(for\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(return\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(let\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(var\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(class\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(match\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(true\b)" >> [](auto& m) { m.add(Keyword); },
+        R"(false\b)" >> [](auto& m) { m.add(Keyword); },
+        R"([[:digit:]]+\.[[:digit:]]+(?:e[+-]?[[:digit:]]+)?\b)" >>
+          [](auto& m) { m.add(Float); },
+        R"(0x[[:xdigit:]]+\b)" >> [](auto& m) { m.add(Int); },
+        R"([[:digit:]]+\b)" >> [](auto& m) { m.add(Int); },
+        R"([_[:alpha:]][_[:alnum:]]*\b)" >> [](auto& m) { m.add(Ident); },
+        "==|!=|<=|>=|&&|\\|\\||->|=>" >> [](auto& m) { m.add(Op); },
+        R"([-+*/%<>=!&|^~.,:])" >> [](auto& m) { m.add(Op); },
+      });
+
+    p("string",
+      {
+        R"(\\.)" >> [](auto&) {},
+        "[^\"\\\\]+" >> [](auto&) {},
+        "\"" >>
+          [](auto& m) {
+            m.add(String);
+            m.mode("start");
+          },
+      });
+
+    p("comment",
+      {
+        R"([^*]+)" >> [](auto&) {},
+        R"(\*/)" >> [](auto& m) { m.mode("start"); },
+        R"(\*)" >> [](auto&) {},
+      });
+
+    return p;
+  }
+
+  std::string lex_input(size_t size)
+  {
+    const char* snippets[] = {
+      "let x = 42;\n",
+      "var total_count = 0x1F + 3.25e-2 * y;\n",
+      "if (a >= b && c != d) { return a; } else { return b; }\n",
+      "// a line comment with words in it\n",
+      "/* a block comment\n * that spans lines */\n",
+      "while (i < n) { i = i + 1; }\n",
+      "let s = \"a string with \\\"escapes\\\" in it\";\n",
+      "class Point { x: Int; y: Int; }\n",
+      "match v { true => 1, false => 0 }\n",
+      "for (e : items) { print(e.name, e.value); }\n",
+    };
+
+    std::mt19937 rnd(1);
+    std::string text;
+
+    while (text.size() < size)
+      text += snippets[rnd() % std::size(snippets)];
+
+    return text;
+  }
+
+  // Lexes `size` bytes of generated source `reps` times, and reports the
+  // throughput.
+  void lex(size_t size, size_t reps)
+  {
+    auto parser = lexer();
+    auto source = SourceDef::synthetic(lex_input(size));
+    size_t nodes = 0;
+
+    Timer timer;
+
+    for (size_t i = 0; i < reps; i++)
+    {
+      auto ast = parser.sub_parse("bench", File, source);
+      nodes += ast->size();
+    }
+
+    auto secs = timer.seconds();
+    auto bytes = double(source->view().size()) * reps;
+
+    std::cout << std::fixed << std::setprecision(1) << "lex: "
+              << bytes / secs / (1024 * 1024) << " MB/s (" << nodes / reps
+              << " top-level nodes)" << std::endl;
+  }
+}
@@ -0,0 +1,123 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <CLI/CLI.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+  std::atomic<size_t> allocation_count{0};
+}
+
+// These aren't inlined, as GCC would then see memory from malloc passed to
+// operator delete, or memory from operator new passed to free, and warn that
+// they don't match.
+[[gnu::noinline]] void* operator new(size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+
+  if (auto p = std::malloc(size ? size : 1))
+    return p;
+
+  throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace bench
+{
+  size_t allocations()
+  {
+    return allocation_count.load(std::memory_order_relaxed);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  CLI::App app;
+  app.require_subcommand(1);
+
+  size_t n = 10000;
+  size_t reps = 100;
+
+  auto match = app.add_subcommand("match", "Match patterns against nodes");
+  match->add_option("-n", n, "Number of nodes");
+  match->add_option("-r", reps, "Number of repetitions");
+
+  size_t size = 1 << 20;
+  size_t lex_reps = 20;
+
+  auto lex = app.add_subcommand("lex", "Lex generated source text");
+  lex->add_option("-s", size, "Size of the source in bytes");
+  lex->add_option("-r", lex_reps, "Number of repetitions");
+
+  size_t source_size = 64 << 20;
+  size_t source_reps = 10;
+
+  auto source = app.add_subcommand("source", "Load and create sources");
+  source->add_option("-s", source_size, "Size of the file in bytes");
+  source->add_option("-r", source_reps, "Number of repetitions");
+
+  size_t statements = 1000000;
+
+  auto wide = app.add_subcommand("wide", "Rewrite the children of a wide node");
+  wide->add_option("-n", statements, "Number of statements");
+
+  size_t refs = 2000;
+  size_t expr_size = 500;
+  bool lazy = false;
+
+  auto reuse =
+    app.add_subcommand("reuse", "Copy a variable's value into each use");
+  reuse->add_option("-n", refs, "Number of uses");
+  reuse->add_option("-s", expr_size, "Number of nodes in the value");
+  reuse->add_flag("--lazy", lazy, "Use copy-on-write clones");
+
+  size_t leaves = 1000000;
+  size_t reclaim_reps = 10;
+
+  auto reclaim =
+    app.add_subcommand("reclaim", "Free trees on the caller or in the background");
+  reclaim->add_option("-n", leaves, "Number of leaves");
+  reclaim->add_option("-r", reclaim_reps, "Number of repetitions");
+
+  try
+  {
+    app.parse(argc, argv);
+  }
+  catch (const CLI::ParseError& e)
+  {
+    return app.exit(e);
+  }
+
+  if (*match)
+    bench::match(n, reps);
+
+  if (*lex)
+    bench::lex(size, lex_reps);
+
+  if (*source)
+    bench::source(source_size, source_reps);
+
+  if (*wide)
+    bench::wide(statements);
+
+  if (*reuse)
+    bench::reuse(refs, expr_size, lazy);
+
+  if (*reclaim)
+    bench::reclaim(leaves, reclaim_reps);
+
+  return 0;
+}
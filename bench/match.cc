@@ -0,0 +1,92 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <iomanip>
+#include <iostream>
+
+namespace bench
+{
+  inline const auto A = TokenDef("a");
+  inline const auto B = TokenDef("b");
+  inline const auto C = TokenDef("c");
+  inline const auto D = TokenDef("d");
+  inline const auto Z = TokenDef("z");
+  inline const auto X = TokenDef("x");
+
+  // Runs a mix of patterns that succeed, fail early, and fail after
+  // backtracking, at every position in a flat node, reusing a single `Match`
+  // as `PassDef` does. Reports the time and the heap allocations per attempt
+  // for both the compiled programs and the pattern trees.
+  void match(size_t n, size_t reps)
+  {
+    Node top = NodeDef::create(Top);
+    Token types[] = {A, B, C, D};
+
+    for (size_t i = 0; i < n; i++)
+      top->push_back(NodeDef::create(types[i % 4]));
+
+    std::vector<detail::Pattern> patterns = {
+      T(A)[A] * T(B)[B],
+      T(A)[A] * T(B)[B] * T(Z),
+      T(A) * (T(C) / T(B))[X] * T(C) * T(Z),
+      (T(A) / T(B) / T(C))++[X] * T(Z),
+      ~T(A)[A] * !T(Z) * ++T(C) * T(C)[C],
+    };
+
+    std::vector<detail::Program> programs;
+
+    for (auto& pattern : patterns)
+      programs.push_back(pattern.compile());
+
+    Match m(top);
+    size_t hits = 0;
+
+    auto run = [&](auto&& attempt) {
+      for (auto it = top->begin(); it != top->end(); ++it)
+      {
+        for (size_t i = 0; i < patterns.size(); i++)
+        {
+          auto it2 = it;
+          m.reset(top);
+
+          if (attempt(i, it2))
+            hits++;
+        }
+      }
+    };
+
+    auto compiled = [&](size_t i, NodeIt& it) {
+      return programs[i].match(it, top->end(), m);
+    };
+
+    auto tree = [&](size_t i, NodeIt& it) {
+      return patterns[i].match(it, top->end(), m);
+    };
+
+    auto measure = [&](const char* name, auto&& attempt) {
+      // Warm up, so that the scratch space has grown.
+      hits = 0;
+      run(attempt);
+
+      auto allocs = allocations();
+      Timer timer;
+
+      for (size_t r = 0; r < reps; r++)
+        run(attempt);
+
+      auto seconds = timer.seconds();
+      double attempts = double(n) * double(patterns.size()) * double(reps);
+
+      std::cout << std::left << std::setw(10) << name << std::right
+                << std::fixed << std::setprecision(2) << std::setw(10)
+                << (seconds * 1e9 / attempts) << " ns/attempt"
+                << std::setw(10) << (double(allocations() - allocs) / attempts)
+                << " allocs/attempt" << std::setw(10) << (hits / (reps + 1))
+                << " hits" << std::endl;
+    };
+
+    measure("compiled", compiled);
+    measure("tree", tree);
+  }
+}
@@ -0,0 +1,97 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <trieste/reclaim.h>
+
+namespace bench
+{
+  inline const auto Leaf = TokenDef("leaf");
+
+  namespace
+  {
+    // The CPU time used by the calling thread, in seconds, which leaves out
+    // time the reclaimer spends running while the caller waits for a core.
+    // Where that isn't available, this is the time since the first call.
+    double thread_seconds()
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+      timespec ts;
+
+      if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+#endif
+      static Timer timer;
+      return timer.seconds();
+    }
+
+    // A tree of `n` leaves, in groups of 64.
+    Node tree(size_t n)
+    {
+      Node top = Top;
+      Node group;
+
+      for (size_t i = 0; i < n; i++)
+      {
+        if (i % 64 == 0)
+        {
+          group = NodeDef::create(Group);
+          top->push_back(group);
+        }
+
+        group->push_back(NodeDef::create(Leaf));
+      }
+
+      return top;
+    }
+  }
+
+  // Frees `reps` trees of `n` leaves each, first by dropping them on the
+  // calling thread and then by handing them to the reclaimer. Only the time
+  // spent on the calling thread is counted for the reclaimer, as that's what
+  // it takes off the critical path, and it's measured in CPU time, as the
+  // reclaimer can preempt the caller if there are few cores. Debug builds
+  // check each retired tree on the caller, so build with NDEBUG.
+  void reclaim(size_t n, size_t reps)
+  {
+    std::vector<double> drop;
+    std::vector<double> retire;
+
+    for (size_t i = 0; i < reps; i++)
+    {
+      Node top = tree(n);
+      auto start = thread_seconds();
+      top = nullptr;
+      drop.push_back(thread_seconds() - start);
+    }
+
+    for (size_t i = 0; i < reps; i++)
+    {
+      Node top = tree(n);
+      auto start = thread_seconds();
+      trieste::reclaim(std::move(top));
+      retire.push_back(thread_seconds() - start);
+
+      // Don't let the reclaimer fall behind, so that each tree is built
+      // without it running.
+      Reclaimer::get().wait();
+    }
+
+    auto median = [](std::vector<double>& times) {
+      if (times.empty())
+        return 0.0;
+
+      auto mid = times.begin() + times.size() / 2;
+      std::nth_element(times.begin(), mid, times.end());
+      return *mid * 1e3;
+    };
+
+    std::cout << std::fixed << std::setprecision(3) << "reclaim: drop "
+              << median(drop) << " ms, retire " << median(retire)
+              << " ms on the caller (" << n << " leaves)" << std::endl;
+  }
+}
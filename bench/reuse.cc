@@ -0,0 +1,92 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <iomanip>
+#include <iostream>
+#include <trieste/pass.h>
+
+#if __has_include(<sys/resource.h>)
+#  include <sys/resource.h>
+#endif
+
+namespace bench
+{
+  inline const auto Def = TokenDef("def");
+  inline const auto Ref = TokenDef("ref");
+  inline const auto Add = TokenDef("add");
+  inline const auto Value = TokenDef("value", flag::print);
+
+  namespace
+  {
+    // The peak resident set size of the process in MB, or 0 if it isn't
+    // available.
+    double peak_rss()
+    {
+#if __has_include(<sys/resource.h>)
+      rusage usage;
+
+      if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return double(usage.ru_maxrss) / 1024;
+#endif
+      return 0;
+    }
+
+    // A balanced expression of `size` nodes. Every node has a location, as
+    // it would if it were parsed, so that the rewrite that places a copy
+    // doesn't give locations to the nodes in it.
+    Node expr(size_t size)
+    {
+      if (size <= 1)
+        return Value ^ "1";
+
+      auto lhs = (size - 1) / 2;
+      return (Add ^ "+") << expr(lhs) << expr(size - 1 - lhs);
+    }
+  }
+
+  // Replaces each of `refs` references to a definition with a copy of its
+  // value, an expression of `size` nodes, as inlining a variable would. The
+  // copies are then read by hashing the tree and walking every node. Eager
+  // copies make every node up front, while lazy copies share the value's
+  // nodes, as nothing changes them.
+  void reuse(size_t refs, size_t size, bool lazy)
+  {
+    Node block = File << (Def << expr(size));
+
+    for (size_t i = 0; i < refs; i++)
+      block << Ref;
+
+    Node top = Top << block;
+    Node value = block->front()->front();
+    auto rss = peak_rss();
+
+    PassDef pass{
+      dir::topdown | dir::once,
+      {
+        T(Ref) >> [&](Match&) -> Node {
+          return lazy ? lazy_clone(value) : clone(value);
+        },
+      }};
+
+    Timer timer;
+    pass.run(top);
+    auto hash = top->hash();
+    size_t nodes = 0;
+    Walk walk(top, true);
+
+    while (walk.next())
+    {
+      if (walk.entering())
+        nodes++;
+    }
+
+    auto seconds = timer.seconds();
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "reuse: " << (lazy ? "lazy" : "eager") << ", " << seconds
+              << " s, " << (peak_rss() - rss) << " MB peak RSS growth ("
+              << nodes << " nodes read, hash " << std::hex << hash << std::dec
+              << ")" << std::endl;
+  }
+}
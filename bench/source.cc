@@ -0,0 +1,72 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <trieste/source.h>
+
+namespace bench
+{
+  // Loads a generated file of `size` bytes `reps` times, then creates many
+  // small synthetic locations, as a pass does when it builds nodes from
+  // strings, both with distinct and with repeated text. Neither needs a line index until a diagnostic is printed, so the
+  // cost of the first `linecol` is reported separately.
+  void source(size_t size, size_t reps)
+  {
+    auto path = std::filesystem::temp_directory_path() / "trieste_bench.txt";
+
+    {
+      std::ofstream f(path, std::ios::binary);
+      std::string line = "let value = compute(first, second) + 42;\n";
+
+      for (size_t written = 0; written < size; written += line.size())
+        f << line;
+    }
+
+    size_t bytes = 0;
+    Timer load;
+
+    for (size_t i = 0; i < reps; i++)
+      bytes += SourceDef::load(path)->view().size();
+
+    bytes /= reps;
+
+    auto load_secs = load.seconds();
+    auto source = SourceDef::load(path);
+    Timer index;
+    auto [line, col] = source->linecol(source->view().size() - 1);
+    auto index_secs = index.seconds();
+
+    std::filesystem::remove(path);
+
+    size_t count = reps * 10000;
+    size_t len = 0;
+    Timer synthetic;
+
+    for (size_t i = 0; i < count; i++)
+      len += Location("ident_" + std::to_string(i)).len;
+
+    auto synthetic_secs = synthetic.seconds();
+
+    // Folded constants and error messages tend to repeat.
+    Timer repeated;
+
+    for (size_t i = 0; i < count; i++)
+      len += Location(std::to_string(i % 100)).len;
+
+    auto repeated_secs = repeated.seconds();
+
+    std::cout << std::fixed << std::setprecision(2) << "load: "
+              << load_secs * 1e3 / reps << " ms/file (" << bytes << " bytes)"
+              << std::endl
+              << "first linecol: " << index_secs * 1e3 << " ms (" << line + 1
+              << " lines)" << std::endl
+              << "synthetic: " << synthetic_secs * 1e9 / count
+              << " ns/location" << std::endl
+              << "repeated synthetic: " << repeated_secs * 1e9 / count
+              << " ns/location" << std::endl;
+  }
+}
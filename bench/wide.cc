@@ -0,0 +1,47 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#include "bench.h"
+
+#include <iomanip>
+#include <iostream>
+#include <trieste/pass.h>
+
+namespace bench
+{
+  inline const auto Name = TokenDef("name");
+  inline const auto Equals = TokenDef("equals");
+  inline const auto Value = TokenDef("value");
+  inline const auto Semi = TokenDef("semi");
+  inline const auto Stmt = TokenDef("stmt");
+
+  // Groups a flat file of `n` statements, each four tokens long, into one node
+  // per statement in a single pass over the file. Every rewrite removes four
+  // children of the file and inserts one, at the position the pass has
+  // reached.
+  void wide(size_t n)
+  {
+    Node file = NodeDef::create(File);
+    Token types[] = {Name, Equals, Value, Semi};
+
+    for (size_t i = 0; i < n * 4; i++)
+      file->push_back(NodeDef::create(types[i % 4]));
+
+    Node top = Top << file;
+
+    PassDef pass{
+      dir::topdown | dir::once,
+      {
+        In(File) * (T(Name) * T(Equals) * T(Value) * T(Semi))[Stmt] >>
+          [](Match& _) { return Stmt << _[Stmt]; },
+      }};
+
+    Timer timer;
+    auto [result, count, changes] = pass.run(top);
+    auto seconds = timer.seconds();
+
+    std::cout << std::fixed << std::setprecision(2) << "wide: " << seconds
+              << " s, " << (seconds * 1e9 / double(changes))
+              << " ns/rewrite (" << changes << " rewrites, "
+              << file->size() << " children)" << std::endl;
+  }
+}
@@ -2,12 +2,19 @@
 // SPDX-License-Identifier: MIT
 #pragma once
 
+#include "small_vector.h"
 #include "token.h"
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include <new>
 #include <set>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace trieste
@@ -28,23 +35,232 @@ namespace trieste
   }
 
   using Nodes = std::vector<Node>;
-  using NodeIt = Nodes::iterator;
+
+  // Most nodes have at most a few children, so they're stored inline.
+  using Children = SmallVector<Node, 2>;
+  using NodeIt = Children::iterator;
   using NodeRange = std::pair<NodeIt, NodeIt>;
   using NodeSet = std::set<Node, std::owner_less<>>;
 
   template<typename T>
   using NodeMap = std::map<Node, T, std::owner_less<>>;
 
+  namespace detail
+  {
+    // Identifier text is interned as a dense symbol ID, so that symbol tables
+    // hash and compare integers rather than strings. Each ID keeps a copy of
+    // its text, as the source it was first seen in may be freed. IDs start
+    // at 1.
+    class Symbols
+    {
+    private:
+      struct Slot
+      {
+        uint32_t hash = 0;
+        uint32_t id = 0;
+      };
+
+      std::mutex lock;
+      std::vector<std::string> texts = std::vector<std::string>(1);
+      std::vector<Slot> slots = std::vector<Slot>(1024);
+
+      Symbols() = default;
+
+    public:
+      static Symbols& get()
+      {
+        // Never destroyed, as symbol IDs may be used during static
+        // destruction.
+        static auto symbols = new Symbols();
+        return *symbols;
+      }
+
+      uint32_t intern(const Location& loc)
+      {
+        auto text = loc.view();
+        auto hash = static_cast<uint32_t>(std::hash<std::string_view>()(text));
+        std::lock_guard<std::mutex> guard(lock);
+        auto mask = slots.size() - 1;
+        auto i = hash & mask;
+
+        for (; slots[i].id; i = (i + 1) & mask)
+        {
+          if ((slots[i].hash == hash) && (texts[slots[i].id] == text))
+            return slots[i].id;
+        }
+
+        auto id = static_cast<uint32_t>(texts.size());
+        texts.emplace_back(text);
+        slots[i] = {hash, id};
+
+        if (texts.size() * 2 > slots.size())
+          rehash();
+
+        return id;
+      }
+
+    private:
+      void rehash()
+      {
+        std::vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        auto mask = slots.size() - 1;
+
+        for (auto& slot : old)
+        {
+          if (!slot.id)
+            continue;
+
+          auto i = slot.hash & mask;
+
+          while (slots[i].id)
+            i = (i + 1) & mask;
+
+          slots[i] = slot;
+        }
+      }
+    };
+
+    // FNV-1a, which depends only on its input, so that structural hashes are
+    // the same in every run and can key caches kept on disk.
+    constexpr uint64_t hash_seed = 14695981039346656037ull;
+
+    inline uint64_t hash_bytes(uint64_t hash, std::string_view bytes)
+    {
+      for (auto c : bytes)
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+
+      return hash;
+    }
+
+    inline uint64_t hash_value(uint64_t hash, uint64_t value)
+    {
+      for (size_t i = 0; i < 64; i += 8)
+        hash = (hash ^ ((value >> i) & 0xff)) * 1099511628211ull;
+
+      return hash;
+    }
+
+    // Structural hashes are folded to 48 bits, and 0 is reserved to mean
+    // that a hash hasn't been computed.
+    inline uint64_t hash_fold(uint64_t hash)
+    {
+      hash = (hash ^ (hash >> 48)) & ((uint64_t(1) << 48) - 1);
+      return hash ? hash : 1;
+    }
+
+    // The part of a node's structural hash that doesn't depend on its
+    // children. The text is only included for flag::print types.
+    inline uint64_t
+    hash_node(const Token& type, std::string_view text, size_t size)
+    {
+      auto hash = hash_bytes(hash_seed, type.str());
+
+      if (type & flag::print)
+        hash = hash_bytes(hash_value(hash, text.size()), text);
+
+      return hash_value(hash, size);
+    }
+
+    // The number of lazy clones that still share another node's children.
+    // While there are none, changing a node doesn't need to look for them.
+    inline std::atomic<size_t> lazy_views{0};
+  }
+
   class SymtabDef
   {
     friend class NodeDef;
 
   private:
-    // The location in `symbols` is used as an identifier.
-    std::map<Location, Nodes> symbols;
+    // The definitions of each symbol, in the order the symbols were first
+    // bound, with an open-addressing index from symbol ID to entry.
+    struct Entry
+    {
+      uint32_t symbol;
+      Location loc;
+      Nodes nodes;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> index = std::vector<uint32_t>(16);
     std::vector<Node> includes;
     size_t next_id = 0;
 
+    // Set if this table must be rebuilt, because the nodes that bind into it
+    // have changed since it was built. New tables start out dirty.
+    bool dirty = true;
+
+    // Changed whenever a definition or include is added, or the table is
+    // cleared, to invalidate what has been cached about the table. Versions
+    // are drawn from a global counter, so a new table at the address of a
+    // destroyed one can't be mistaken for it.
+    uint64_t version = next_version();
+
+    static uint64_t next_version()
+    {
+      static std::atomic<uint64_t> counter{1};
+      return counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // At the root of a tree, a fingerprint of the bindings the tree's tables
+    // were last built with, or 0 if they haven't been built.
+    uint64_t bindings = 0;
+
+    size_t slot(uint32_t symbol) const
+    {
+      // Symbol IDs are dense, so spread them with a multiplicative hash.
+      auto mask = index.size() - 1;
+      auto i = (symbol * 0x9E3779B9u) & mask;
+
+      while (index[i] && (entries[index[i] - 1].symbol != symbol))
+        i = (i + 1) & mask;
+
+      return i;
+    }
+
+    Nodes* find(uint32_t symbol)
+    {
+      auto i = index[slot(symbol)];
+      return i ? &entries[i - 1].nodes : nullptr;
+    }
+
+    Nodes& insert(uint32_t symbol, const Location& loc)
+    {
+      auto i = slot(symbol);
+
+      if (index[i])
+        return entries[index[i] - 1].nodes;
+
+      entries.push_back({symbol, loc, {}});
+      index[i] = static_cast<uint32_t>(entries.size());
+
+      if (entries.size() * 2 > index.size())
+      {
+        index.assign(index.size() * 2, 0);
+
+        for (size_t j = 0; j < entries.size(); j++)
+          index[slot(entries[j].symbol)] = static_cast<uint32_t>(j + 1);
+      }
+
+      return entries.back().nodes;
+    }
+
+    // The entries in the order of their text, as a std::map keyed by location
+    // would have them.
+    std::vector<Entry*> sorted()
+    {
+      std::vector<Entry*> result;
+
+      for (auto& entry : entries)
+        result.push_back(&entry);
+
+      std::sort(result.begin(), result.end(), [](auto a, auto b) {
+        return a->loc < b->loc;
+      });
+
+      return result;
+    }
+
   public:
     SymtabDef() = default;
 
@@ -57,14 +273,16 @@ namespace trieste
     void clear()
     {
       // Don't reset next_id, so that we don't reuse identifiers.
-      symbols.clear();
+      version = next_version();
+      entries.clear();
+      std::fill(index.begin(), index.end(), 0);
       includes.clear();
     }
 
     void str(std::ostream& out, size_t level);
   };
 
-  using Symtab = std::shared_ptr<SymtabDef>;
+  using Symtab = std::unique_ptr<SymtabDef>;
 
   struct Index
   {
@@ -75,33 +293,514 @@ namespace trieste
     Index(const Token& type, size_t index) : type(type), index(index) {}
   };
 
-  class NodeDef : public std::enable_shared_from_this<NodeDef>
+  namespace detail
+  {
+    // Nodes are carved out of large, aligned slabs held by the allocating
+    // thread. A slab counts the nodes that are still alive in it, plus one
+    // while a thread holds it. Freed nodes go on their slab's free list, from
+    // any thread. Allocating a node is usually a pointer bump or a pop from a
+    // free list. Every allocation is a node, so any freed slot fits any
+    // allocation.
+    //
+    // Once the slab being allocated from is full, its freed slots are reused
+    // first, then a held slab that is empty. Nodes allocated together are
+    // faster to walk when they're close together, so the freed slots of other
+    // slabs are only reused once the held slabs are more than half empty.
+    // That way a few long-lived nodes don't each pin a slab that nothing else
+    // can use. After as many refills as there are held slabs, the empty ones
+    // are returned to the system. A slab that is no longer held, because its
+    // thread has exited, is returned to the system when its last node dies.
+    class NodeArena
+    {
+    private:
+      static constexpr size_t slab_size = 64 * 1024;
+      static constexpr size_t header_size = 64;
+
+      // How many held slabs to look at for freed slots before making a new
+      // slab.
+      static constexpr size_t probes = 16;
+
+      struct Slab
+      {
+        std::atomic<size_t> live;
+
+        // Freed slots, linked through their first word.
+        std::atomic<void*> freed = nullptr;
+      };
+
+      inline static std::atomic<size_t> slab_count = 0;
+
+      // The slabs this thread holds, and the one it's allocating from.
+      std::vector<Slab*> slabs;
+      size_t cursor = 0;
+      size_t refills = 0;
+      bool recycle = false;
+      Slab* slab = nullptr;
+      void* reuse = nullptr;
+      char* next = nullptr;
+      char* limit = nullptr;
+
+      NodeArena() = default;
+
+    public:
+      NodeArena(const NodeArena&) = delete;
+
+      ~NodeArena()
+      {
+        for (auto s : slabs)
+          release(s);
+      }
+
+      static NodeArena& get()
+      {
+        thread_local NodeArena arena;
+        return arena;
+      }
+
+      // The number of slabs that haven't been returned to the system, on all
+      // threads.
+      static size_t count()
+      {
+        return slab_count.load(std::memory_order_relaxed);
+      }
+
+      void* alloc(size_t size)
+      {
+        size = (size + alignof(std::max_align_t) - 1) &
+          ~(alignof(std::max_align_t) - 1);
+
+        if (size > (slab_size - header_size))
+          throw std::bad_alloc();
+
+        while (!reuse && (static_cast<size_t>(limit - next) < size))
+          refill(size);
+
+        void* p;
+
+        if (reuse)
+        {
+          p = reuse;
+          reuse = *static_cast<void**>(p);
+        }
+        else
+        {
+          p = next;
+          next += size;
+        }
+
+        slab->live.fetch_add(1, std::memory_order_relaxed);
+        return p;
+      }
+
+      static void free(void* p)
+      {
+        auto addr = reinterpret_cast<uintptr_t>(p) & ~(slab_size - 1);
+        auto s = reinterpret_cast<Slab*>(addr);
+
+        // The slot is added to the free list before the node stops counting,
+        // so that the slab can't be returned to the system first.
+        auto head = s->freed.load(std::memory_order_relaxed);
+
+        do
+        {
+          *static_cast<void**>(p) = head;
+        } while (!s->freed.compare_exchange_weak(
+          head, p, std::memory_order_release, std::memory_order_relaxed));
+
+        release(s);
+      }
+
+    private:
+      void refill(size_t size)
+      {
+        if (++refills > slabs.size())
+          trim(size);
+
+        // Take the slots freed in the current slab, then look for a held slab
+        // that has freed slots or is empty.
+        if (slab)
+          reuse = slab->freed.exchange(nullptr, std::memory_order_acquire);
+
+        if (reuse)
+          return;
+
+        for (size_t i = 0; i < std::min(probes, slabs.size()); i++)
+        {
+          cursor = (cursor + 1) % slabs.size();
+          auto s = slabs[cursor];
+
+          if (s == slab)
+            continue;
+
+          auto live = s->live.load(std::memory_order_acquire);
+
+          if (live == 1)
+          {
+            // Nothing in the slab is alive, so start it over.
+            use(s);
+            s->freed.store(nullptr, std::memory_order_relaxed);
+            return;
+          }
+
+          // Only move to a slab that is at least a quarter free. Every slot
+          // in a slab that isn't being allocated from has been handed out.
+          if (!recycle || ((live - 1) * 4 > capacity(size) * 3))
+            continue;
+
+          if (auto f = s->freed.exchange(nullptr, std::memory_order_acquire))
+          {
+            use(s);
+            next = limit = nullptr;
+            reuse = f;
+            return;
+          }
+        }
+
+        auto mem = static_cast<char*>(
+          ::operator new(slab_size, std::align_val_t(slab_size)));
+        auto s = new (mem) Slab{1};
+        slab_count.fetch_add(1, std::memory_order_relaxed);
+        slabs.push_back(s);
+        use(s);
+      }
+
+      void use(Slab* s)
+      {
+        auto mem = reinterpret_cast<char*>(s);
+        slab = s;
+        reuse = nullptr;
+        next = mem + header_size;
+        limit = mem + slab_size;
+      }
+
+      static size_t capacity(size_t size)
+      {
+        return (slab_size - header_size) / size;
+      }
+
+      // Returns the held slabs that are empty to the system, and checks how
+      // full the rest are.
+      void trim(size_t size)
+      {
+        size_t used = 0;
+
+        for (size_t i = 0; i < slabs.size();)
+        {
+          auto s = slabs[i];
+          auto live = s->live.load(std::memory_order_acquire);
+
+          if ((s != slab) && (live == 1))
+          {
+            slabs[i] = slabs.back();
+            slabs.pop_back();
+            release(s);
+          }
+          else
+          {
+            used += live - 1;
+            i++;
+          }
+        }
+
+        cursor = 0;
+        refills = 0;
+        recycle = (used * 2) < (slabs.size() * capacity(size));
+      }
+
+      static void release(Slab* s)
+      {
+        if (s->live.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+          s->~Slab();
+          ::operator delete(s, std::align_val_t(slab_size));
+          slab_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+      }
+    };
+  }
+
+  class Walk;
+  class LookupCache;
+
+  class NodeDef
   {
+    friend class intrusive_ptr<NodeDef>;
+    friend class Walk;
+    friend class LookupCache;
+
   private:
     Token type_;
     Location location_;
+
+    // The interned symbol ID of `location_`, or 0 if it hasn't been needed.
+    uint32_t symbol_ = 0;
     Symtab symtab_;
+
+    // The lazy clones that still share this node's children, if there are
+    // any. This is a set, so that taking a clone off it doesn't depend on how
+    // many share the node. Like reference counts, this is only used by one
+    // thread at a time, so it needs no lock.
+    std::unique_ptr<std::unordered_set<NodeDef*>> views_;
+
     NodeDef* parent_;
-    Nodes children;
+    Children children;
+    uint32_t refcount_;
+
+    // Where this node was last seen in its parent's children. This is only a
+    // hint: it's checked before use, and the parent's children are reindexed
+    // if it's wrong.
+    uint32_t index_ = 0;
+
+    // Change tracking for incremental symbol table builds. `st_changed` means
+    // this node's children have changed since the last build, and
+    // `st_below` means this node or one of its descendants has.
+    static constexpr uint8_t st_changed = 1 << 0;
+    static constexpr uint8_t st_below = 1 << 1;
+    uint8_t st_flags_ = 0;
+
+    // Set if this node or one of its descendants might have no location, so
+    // that set_location can skip subtrees that are fully located. Like the
+    // summary, adding a child updates this node and its ancestors.
+    bool unlocated_ : 1;
+
+    // Set if this is a lazy clone, whose only child is the node it's a clone
+    // of, and whose real children haven't been made yet.
+    bool lazy_ : 1 = false;
+
+    // The structural hash of this subtree, or 0 if it hasn't been computed
+    // since the subtree last changed. If a node's hash is 0, so is the hash of
+    // each of its ancestors. This fits in what would otherwise be padding.
+    uint64_t hash_ : 48 = 0;
+
+    // The summary bits of the node types in this subtree, including this
+    // node. Adding a child updates this node and its ancestors, but removing
+    // one doesn't, so this can include types that are no longer present until
+    // it's refreshed.
+    uint64_t summary_;
 
     NodeDef(const Token& type, Location location)
-    : type_(type), location_(location), parent_(nullptr)
+    : type_(type),
+      location_(location),
+      parent_(nullptr),
+      refcount_(0),
+      unlocated_(location.source_id == 0),
+      summary_(type.summary_bit())
     {
+      retain_source();
+
       if (type_ & flag::symtab)
-        symtab_ = std::make_shared<SymtabDef>();
+        symtab_ = std::make_unique<SymtabDef>();
+    }
+
+    // A node keeps the source of its location alive.
+    void retain_source()
+    {
+      if (location_.source_id)
+        location_.source()->intrusive_inc_ref();
+    }
+
+    void intrusive_inc_ref()
+    {
+      ++refcount_;
+    }
+
+    void intrusive_dec_ref()
+    {
+      if (--refcount_ == 0)
+        destroy(this);
+    }
+
+    // Deleting a node releases its children, which would delete them in turn
+    // and recurse as deep as the tree. Instead, nodes released while another
+    // node is being deleted are queued, and deleted one at a time. A queued
+    // node is unreachable, so its parent pointer is used to link the queue.
+    static void destroy(NodeDef* node)
+    {
+      thread_local NodeDef* queue = nullptr;
+      thread_local bool deleting = false;
+
+      if (deleting)
+      {
+        node->parent_ = queue;
+        queue = node;
+        return;
+      }
+
+      deleting = true;
+      delete node;
+
+      while (queue)
+      {
+        node = queue;
+        queue = node->parent_;
+        delete node;
+      }
+
+      deleting = false;
+    }
+
+    void changed()
+    {
+      st_flags_ |= st_changed;
+      changed_below();
+      invalidate_hash();
+    }
+
+    void invalidate_hash()
+    {
+      for (auto p = this; p && p->hash_; p = p->parent_)
+        p->hash_ = 0;
+    }
+
+    void changed_below()
+    {
+      // If a node is already marked, so are its ancestors.
+      for (auto p = this; p && !(p->st_flags_ & st_below); p = p->parent_)
+        p->st_flags_ |= st_below;
+    }
+
+    // Marks the tables that depend on changed nodes as dirty. A changed node
+    // can affect the table it binds into, and the table its children bind
+    // into, which is its own if it has one.
+    void mark_dirty_symbols(uint64_t binders);
+
+    template<typename F>
+    bool rebuild_symbols(
+      bool full, F& bind, std::vector<NodeDef*>& failed, uint64_t binders);
+
+    // True if this is a lazy clone whose shared children have no node that
+    // binds or has a symbol table, going by the summary bits in `binders`.
+    // Symbol table builds can leave those children shared.
+    bool binds_nothing(uint64_t binders) const
+    {
+      return lazy_ && !(summary_ & binders);
+    }
+
+    // The node whose children this node has, which is its source if it's a
+    // lazy clone.
+    NodeDef* content()
+    {
+      return lazy_ ? children.front().get() : this;
+    }
+
+    const NodeDef* content() const
+    {
+      return lazy_ ? children.front().get() : this;
+    }
+
+    // This node's own children, made first if it's a lazy clone.
+    Children& contents()
+    {
+      if (lazy_)
+        expand();
+
+      return children;
+    }
+
+    // Replaces the source of a lazy clone with lazy clones of the source's
+    // children.
+    void expand();
+
+    // Gives each lazy clone that shares this node's children, or those of an
+    // ancestor, its own children down to this node, so that this node can be
+    // changed without the clones seeing it.
+    void unshare()
+    {
+      if (detail::lazy_views.load(std::memory_order_relaxed) != 0)
+        unshare_path();
+    }
+
+    void unshare_path();
+
+    // Calls `f(n, ordered)` on each node in this node's symbol table that a
+    // lookup of `sym` can find, which are the definitions with flag::lookup
+    // and then the includes. If `ordered` is true, `n` is only found from a
+    // reference it precedes. Returns false if `f` does, without visiting the
+    // rest.
+    template<typename F>
+    bool lookup_here(uint32_t sym, F&& f)
+    {
+      // If the type of the symbol table is flag::defbeforeuse, then the
+      // definition has to appear earlier in the same file.
+      bool defbeforeuse = type_ & flag::defbeforeuse;
+
+      if (auto defs = symtab_->find(sym))
+      {
+        for (auto& n : *defs)
+        {
+          if ((n->type() & flag::lookup) && !f(n, defbeforeuse))
+            return false;
+        }
+      }
+
+      // Includes are always returned, regardless of what's being looked up.
+      for (auto& n : symtab_->includes)
+      {
+        if (!f(n, false))
+          return false;
+      }
+
+      return true;
+    }
+
+    void release_view(NodeDef* source)
+    {
+      auto& views = *source->views_;
+      views.erase(this);
+      detail::lazy_views.fetch_sub(1, std::memory_order_relaxed);
+
+      if (views.empty())
+        source->views_.reset();
+    }
+
+    void add_summary(uint64_t summary, bool unlocated)
+    {
+      // If a node already has these bits, so do its ancestors.
+      for (auto p = this; p &&
+           (((p->summary_ & summary) != summary) ||
+            (unlocated && !p->unlocated_));
+           p = p->parent_)
+      {
+        p->summary_ |= summary;
+        p->unlocated_ |= unlocated;
+      }
     }
 
   public:
-    ~NodeDef() {}
+    ~NodeDef()
+    {
+      if (lazy_)
+        release_view(children.front().get());
+
+      // A child that outlives this node must not point back to it.
+      for (auto& c : children)
+      {
+        if (c->parent_ == this)
+          c->parent_ = nullptr;
+      }
+
+      if (location_.source_id)
+        location_.source()->intrusive_dec_ref();
+    }
+
+    static void* operator new(size_t size)
+    {
+      return detail::NodeArena::get().alloc(size);
+    }
+
+    static void operator delete(void* p)
+    {
+      detail::NodeArena::free(p);
+    }
 
     static Node create(const Token& type)
     {
-      return std::shared_ptr<NodeDef>(new NodeDef(type, {nullptr, 0, 0}));
+      return Node(new NodeDef(type, {nullptr, 0, 0}));
     }
 
     static Node create(const Token& type, Location location)
     {
-      return std::shared_ptr<NodeDef>(new NodeDef(type, location));
+      return Node(new NodeDef(type, location));
     }
 
     static Node create(const Token& type, NodeRange range)
@@ -109,10 +808,16 @@ namespace trieste
       if (range.first == range.second)
         return create(type);
 
-      return std::shared_ptr<NodeDef>(new NodeDef(
+      return Node(new NodeDef(
         type, (*range.first)->location_ * (*(range.second - 1))->location_));
     }
 
+    Node shared_from_this()
+    {
+      // Kept so that code written against the shared_ptr API still compiles.
+      return Node(this);
+    }
+
     const Token& type() const
     {
       return type_;
@@ -123,11 +828,34 @@ namespace trieste
       return type_.in(list);
     }
 
+    bool in(const TokenSet& set) const
+    {
+      return type_.in(set);
+    }
+
     const Location& location() const
     {
       return location_;
     }
 
+    uint64_t summary() const
+    {
+      return summary_;
+    }
+
+    // Recomputes the summary from the children's summaries.
+    void refresh_summary()
+    {
+      // A lazy clone has the summary of its source.
+      if (lazy_)
+        return;
+
+      summary_ = type_.summary_bit();
+
+      for (auto& c : children)
+        summary_ |= c->summary_;
+    }
+
     NodeDef* parent()
     {
       return parent_;
@@ -145,7 +873,7 @@ namespace trieste
       while (p)
       {
         if (p->type_.in(list))
-          return p->shared_from_this();
+          return Node(p);
 
         p = p->parent_;
       }
@@ -153,68 +881,91 @@ namespace trieste
       return {};
     }
 
-    void set_location(const Location& loc)
-    {
-      if (!location_.source)
-        location_ = loc;
-
-      for (auto& c : children)
-        c->set_location(loc);
-    }
+    // Gives `loc` to each node in this subtree that has no location.
+    void set_location(const Location& loc);
 
     void extend(const Location& loc)
     {
+      unshare();
       location_ *= loc;
+      symbol_ = 0;
+      invalidate_hash();
+    }
+
+    // This node's children, for reading only. A lazy clone's children aren't
+    // made, so its source's are returned instead.
+    const Children& peek() const
+    {
+      return content()->children;
     }
 
     auto begin()
     {
-      return children.begin();
+      return contents().begin();
     }
 
     auto end()
     {
-      return children.end();
+      return contents().end();
     }
 
     auto rbegin()
     {
-      return children.rbegin();
+      return contents().rbegin();
     }
 
     auto rend()
     {
-      return children.rend();
+      return contents().rend();
+    }
+
+    // Returns an iterator up to `n` children before `it`, from which the
+    // children can be iterated over up to end() without calling begin().
+    NodeIt rewind(NodeIt it, size_t n)
+    {
+      return contents().rewind(it, n);
     }
 
     auto find(Node node)
     {
-      return std::find(children.begin(), children.end(), node);
+      return std::find(begin(), end(), node);
     }
 
     bool empty()
     {
-      return children.empty();
+      return size() == 0;
     }
 
+    // True if there is only one handle to this node.
+    bool unique() const
+    {
+      return refcount_ == 1;
+    }
+
+    // True if the only reference to a node in this subtree from outside it is
+    // a single handle to this node. References from the subtree's own symbol
+    // tables don't count. A subtree with lazy clones in it, or of anything in
+    // it, is never exclusive. This walks the whole subtree.
+    bool exclusive() const;
+
     size_t size() const
     {
-      return children.size();
+      return content()->children.size();
     }
 
     Node& at(size_t index)
     {
-      return children.at(index);
+      return contents().at(index);
     }
 
     Node& front()
     {
-      return children.front();
+      return contents().front();
     }
 
     Node& back()
     {
-      return children.back();
+      return contents().back();
     }
 
     void push_front(Node node)
@@ -222,8 +973,12 @@ namespace trieste
       if (!node)
         return;
 
-      children.insert(children.begin(), node);
+      unshare();
+      auto& c = contents();
+      c.insert(c.begin(), node);
       node->parent_ = this;
+      add_summary(node->summary_, node->unlocated_);
+      changed();
     }
 
     void push_back(Node node)
@@ -231,8 +986,12 @@ namespace trieste
       if (!node)
         return;
 
-      children.push_back(node);
+      unshare();
+      contents().push_back(node);
       node->parent_ = this;
+      node->index_ = static_cast<uint32_t>(children.size() - 1);
+      add_summary(node->summary_, node->unlocated_);
+      changed();
     }
 
     void push_back(NodeIt it)
@@ -252,7 +1011,10 @@ namespace trieste
         return;
 
       // Don't set the parent of the new child node to `this`.
-      children.push_back(node);
+      unshare();
+      contents().push_back(node);
+      add_summary(node->summary_, node->unlocated_);
+      changed();
     }
 
     void push_back_ephemeral(NodeRange range)
@@ -263,17 +1025,21 @@ namespace trieste
 
     Node pop_back()
     {
-      if (children.empty())
+      if (empty())
         return {};
 
-      auto node = children.back();
+      unshare();
+      auto node = contents().back();
       children.pop_back();
       node->parent_ = nullptr;
+      changed();
       return node;
     }
 
     NodeIt erase(NodeIt first, NodeIt last)
     {
+      unshare();
+
       for (auto it = first; it != last; ++it)
       {
         // Only clear the parent if the node is not shared.
@@ -281,6 +1047,7 @@ namespace trieste
           (*it)->parent_ = nullptr;
       }
 
+      changed();
       return children.erase(first, last);
     }
 
@@ -289,8 +1056,11 @@ namespace trieste
       if (!node)
         return pos;
 
+      unshare();
       node->parent_ = this;
-      return children.insert(pos, node);
+      add_summary(node->summary_, node->unlocated_);
+      changed();
+      return contents().insert(pos, node);
     }
 
     NodeIt insert(NodeIt pos, NodeIt first, NodeIt last)
@@ -298,10 +1068,27 @@ namespace trieste
       if (first == last)
         return pos;
 
+      unshare();
+      uint64_t summary = 0;
+      bool unlocated = false;
+
       for (auto it = first; it != last; ++it)
+      {
         (*it)->parent_ = this;
+        summary |= (*it)->summary_;
+        unlocated |= (*it)->unlocated_;
+      }
+
+      add_summary(summary, unlocated);
+      changed();
+      return contents().insert(pos, first, last);
+    }
 
-      return children.insert(pos, first, last);
+    // The version of this node's symbol table, or 0 if it has none. This
+    // changes whenever the table's contents do.
+    uint64_t symtab_version() const
+    {
+      return symtab_ ? symtab_->version : 0;
     }
 
     Node scope()
@@ -310,12 +1097,10 @@ namespace trieste
 
       while (p)
       {
-        auto node = p->shared_from_this();
+        if (p->symtab_)
+          return Node(p);
 
-        if (node->symtab_)
-          return node;
-
-        p = node->parent_;
+        p = p->parent_;
       }
 
       return {};
@@ -327,8 +1112,14 @@ namespace trieste
       if (!symtab_)
         return result;
 
-      for (auto& [loc, nodes] : symtab_->symbols)
-        std::copy_if(nodes.begin(), nodes.end(), std::back_inserter(result), f);
+      for (auto entry : symtab_->sorted())
+      {
+        std::copy_if(
+          entry->nodes.begin(),
+          entry->nodes.end(),
+          std::back_inserter(result),
+          f);
+      }
 
       return result;
     }
@@ -339,55 +1130,109 @@ namespace trieste
       if (!symtab_)
         return result;
 
-      auto it = symtab_->symbols.find(loc);
-      if (it == symtab_->symbols.end())
+      return get_symbols(
+        detail::Symbols::get().intern(loc), result, std::forward<F>(f));
+    }
+
+    template<typename F>
+    Nodes& get_symbols(uint32_t symbol, Nodes& result, F&& f)
+    {
+      if (!symtab_)
         return result;
 
-      std::copy_if(
-        it->second.begin(), it->second.end(), std::back_inserter(result), f);
+      auto nodes = symtab_->find(symbol);
+      if (!nodes)
+        return result;
 
+      std::copy_if(nodes->begin(), nodes->end(), std::back_inserter(result), f);
       return result;
     }
 
+    // The interned symbol ID of this node's location.
+    uint32_t symbol()
+    {
+      if (!symbol_)
+        symbol_ = detail::Symbols::get().intern(location_);
+
+      return symbol_;
+    }
+
     void clear_symbols()
     {
       if (symtab_)
         symtab_->clear();
     }
 
+    // Builds the symbol tables in this tree, calling `bind` on each node
+    // whose binding must be recorded. Nodes are visited in the same order as
+    // a full rebuild, but if the tree was last built with the same `bindings`
+    // fingerprint, only the tables affected by changes since then are
+    // cleared and rebuilt. A table that failed to build stays dirty, so its
+    // errors are reported again by the next build. `binders` has the summary
+    // bits of every type that `bind` records or that has a symbol table, and
+    // lazy clones with none of those in them are left shared.
+    template<typename F>
+    bool build_symbols(uint64_t bindings, F&& bind, uint64_t binders = ~0ull)
+    {
+      auto full = !symtab_ || (symtab_->bindings != bindings);
+
+      if (symtab_)
+        symtab_->bindings = bindings;
+
+      if (!full && (st_flags_ & st_below))
+        mark_dirty_symbols(binders);
+
+      std::vector<NodeDef*> failed;
+      auto ok = rebuild_symbols(full, bind, failed, binders);
+
+      for (auto st : failed)
+      {
+        st->symtab_->dirty = true;
+        st->changed_below();
+      }
+
+      return ok;
+    }
+
     Nodes lookup(Node until = {})
     {
       Nodes result;
-      auto st = scope();
+      lookup_each(
+        [&](const Node& n) {
+          result.push_back(n);
+          return true;
+        },
+        until);
+      return result;
+    }
+
+    // Calls `f` on each node that `lookup` would return, in the same order,
+    // without building a vector of them. If `f` returns false, no more nodes
+    // are visited.
+    template<typename F>
+    void lookup_each(F&& f, Node until = {})
+    {
+      auto sym = symbol();
+      bool shadowing = false;
 
-      while (st)
+      for (auto st = scope(); st; st = st->scope())
       {
-        // If the type of the symbol table is flag::defbeforeuse, then the
-        // definition has to appear earlier in the same file.
-        st->get_symbols(location_, result, [&](auto& n) {
-          return (n->type() & flag::lookup) &&
-            (!(st->type() & flag::defbeforeuse) || n->precedes(this));
+        auto more = st->lookup_here(sym, [&](const Node& n, bool ordered) {
+          if (ordered && !n->precedes(this))
+            return true;
+
+          shadowing = shadowing || (n->type() & flag::shadowing);
+          return f(n);
         });
 
-        // Includes are always returned, regardless of what's being looked up.
-        result.insert(
-          result.end(),
-          st->symtab_->includes.begin(),
-          st->symtab_->includes.end());
+        if (!more)
+          return;
 
         // If we've reached the scope limit or there are no shadowing
         // definitions, don't continue to the next scope.
-        if (
-          (st == until) ||
-          std::any_of(result.begin(), result.end(), [](auto& n) {
-            return n->type() & flag::shadowing;
-          }))
+        if ((st == until) || shadowing)
           break;
-
-        st = st->scope();
       }
-
-      return result;
     }
 
     Nodes lookdown(const Location& loc)
@@ -416,8 +1261,10 @@ namespace trieste
       if (!st)
         throw std::runtime_error("No symbol table");
 
-      auto& entry = st->symtab_->symbols[loc];
-      entry.push_back(shared_from_this());
+      auto& entry =
+        st->symtab_->insert(detail::Symbols::get().intern(loc), loc);
+      entry.push_back(Node(this));
+      st->symtab_->version = SymtabDef::next_version();
 
       // If there are multiple definitions, none can be shadowing.
       return (entry.size() == 1) ||
@@ -433,7 +1280,8 @@ namespace trieste
       if (!st)
         throw std::runtime_error("No symbol table");
 
-      st->symtab_->includes.emplace_back(shared_from_this());
+      st->symtab_->includes.emplace_back(this);
+      st->symtab_->version = SymtabDef::next_version();
     }
 
     Location fresh(const Location& prefix = {})
@@ -450,27 +1298,35 @@ namespace trieste
       return p->symtab_->fresh(prefix);
     }
 
-    Node clone()
-    {
-      // This doesn't preserve the symbol table.
-      auto node = create(type_, location_);
+    // This doesn't preserve the symbol table.
+    Node clone();
 
-      for (auto& child : children)
-        node->push_back(child->clone());
+    // A copy-on-write clone, which shares this node's children until either
+    // side changes. Its children are made as they're needed, and are
+    // themselves lazy clones. Reading the copy with str, hash, equals, clone
+    // or errors doesn't make its children. This doesn't preserve the symbol
+    // table.
+    Node lazy_clone();
 
-      return node;
+    bool lazy() const
+    {
+      return lazy_;
     }
 
     void replace(Node node1, Node node2 = {})
     {
-      auto it = std::find(children.begin(), children.end(), node1);
+      unshare();
+      auto it = std::find(begin(), end(), node1);
       if (it == children.end())
         throw std::runtime_error("Node not found");
 
+      changed();
+
       if (node2)
       {
         node1->parent_ = nullptr;
         node2->parent_ = this;
+        add_summary(node2->summary_, node2->unlocated_);
         it->swap(node2);
       }
       else
@@ -481,23 +1337,22 @@ namespace trieste
 
     void lookup_replace(Node& node1, Node& node2)
     {
+      unshare();
       assert(node1->parent_ == this);
       node1->parent_ = nullptr;
       node2->parent_ = this;
+      add_summary(node2->summary_, node2->unlocated_);
+      changed();
       node1 = node2;
     }
 
-    bool equals(Node& node)
-    {
-      return (type_ == node->type()) &&
-        (!(type_ & flag::print) || (location_ == node->location_)) &&
-        (std::equal(
-          children.begin(),
-          children.end(),
-          node->children.begin(),
-          node->children.end(),
-          [](auto& a, auto& b) { return a->equals(b); }));
-    }
+    // A 48-bit hash of the types of the nodes in this subtree, the text of
+    // those with flag::print, and its shape, so that subtrees that are equal
+    // have the same hash. It's cached, and recomputed after the subtree
+    // changes.
+    uint64_t hash();
+
+    bool equals(Node& node);
 
     Node common_parent(Node node)
     {
@@ -510,10 +1365,10 @@ namespace trieste
 
       // If p and q are the same, then one is contained within the other.
       if (p == q)
-        return p->shared_from_this();
+        return Node(p);
 
       // Otherwise return the common parent.
-      return p->parent_->shared_from_this();
+      return Node(p->parent_);
     }
 
     bool precedes(Node node)
@@ -533,58 +1388,40 @@ namespace trieste
 
       // Check that p is to the left of q.
       auto parent = p->parent_;
-      return parent->find(p->shared_from_this()) <
-        parent->find(q->shared_from_this());
+      return parent->child_index(p) < parent->child_index(q);
     }
 
-    void str(std::ostream& out, size_t level) const
-    {
-      out << indent(level) << "(" << type_.str();
-
-      if (type_ & flag::print)
-        out << " " << location_.view().size() << ":" << location_.view();
+    void str(std::ostream& out, size_t level) const;
 
-      if (symtab_)
-      {
-        out << std::endl;
-        symtab_->str(out, level + 1);
-      }
+    bool errors(std::ostream& out) const;
 
-      for (auto child : children)
-      {
-        out << std::endl;
-        child->str(out, level + 1);
-      }
-
-      out << ")";
-    }
-
-    bool errors(std::ostream& out) const
+  private:
+    // The position of `child` in this node's children, or the number of
+    // children if it isn't one. Edits that shift children leave stale hints
+    // behind, which are all fixed at once the first time one is found, so
+    // repeated comparisons between siblings are O(1).
+    size_t child_index(NodeDef* child)
     {
-      bool err = false;
+      auto i = child->index_;
 
-      for (auto& child : children)
-        err = child->errors(out) || err;
+      if ((i < children.size()) && (children[i].get() == child))
+        return i;
 
-      // If an error wraps another error, print only the innermost error.
-      if (err || (type_ != Error))
-        return err;
-
-      for (auto& child : children)
+      for (size_t j = 0; j < children.size(); j++)
       {
-        if (child->type() == ErrorMsg)
-          out << child->location().view() << std::endl;
-        else
-          out << child->location().origin_linecol() << std::endl
-              << child->location().str();
+        // Don't overwrite the hint of a node that belongs to another parent.
+        if (children[j]->parent_ == this)
+          children[j]->index_ = static_cast<uint32_t>(j);
       }
 
-      // Trailing blank line.
-      out << std::endl;
-      return true;
+      i = child->index_;
+
+      if ((i < children.size()) && (children[i].get() == child))
+        return i;
+
+      return children.size();
     }
 
-  private:
     std::pair<NodeDef*, NodeDef*> same_parent(NodeDef* q)
     {
       auto p = this;
@@ -613,6 +1450,803 @@ namespace trieste
     }
   };
 
+  // A depth-first walk of a subtree that keeps its own stack, so that deep
+  // trees don't overflow the call stack. Each node is visited twice: when
+  // it's entered, before its children, and when it's left, after them, which
+  // gives both a pre-order and a post-order. A node's children can be changed
+  // when it's entered, but otherwise the tree shouldn't be changed during a
+  // walk. A read-only walk visits the children of a lazy clone's source,
+  // rather than making the clone's own children.
+  class Walk
+  {
+  private:
+    struct Frame
+    {
+      NodeDef* node;
+      size_t next;
+    };
+
+    NodeDef* root_;
+    std::vector<Frame> stack_;
+    bool entering_ = false;
+    bool read_only_;
+
+  public:
+    Walk(NodeDef* root, bool read_only = false)
+    : root_(root), read_only_(read_only)
+    {}
+
+    Walk(const Node& root, bool read_only = false)
+    : root_(root.get()), read_only_(read_only)
+    {}
+
+    // Moves to the next visit, or returns false if the walk is finished.
+    bool next()
+    {
+      if (root_)
+      {
+        stack_.push_back({root_, 0});
+        root_ = nullptr;
+        entering_ = true;
+        return true;
+      }
+
+      if (!entering_ && !stack_.empty())
+        stack_.pop_back();
+
+      if (stack_.empty())
+        return false;
+
+      auto& top = stack_.back();
+
+      if (top.next < top.node->size())
+      {
+        auto& children =
+          read_only_ ? top.node->content()->children : top.node->contents();
+        auto child = children[top.next++].get();
+        stack_.push_back({child, 0});
+        entering_ = true;
+      }
+      else
+      {
+        entering_ = false;
+      }
+
+      return true;
+    }
+
+    NodeDef* node() const
+    {
+      return stack_.back().node;
+    }
+
+    // The node whose children the current node was found in, or null at the
+    // root. In a read-only walk, this is the source of a lazy clone that's
+    // read through, as that's the parent of the shared children.
+    NodeDef* parent() const
+    {
+      return (stack_.size() > 1) ? stack_[stack_.size() - 2].node->content() :
+                                   nullptr;
+    }
+
+    // The depth of the current node below the root.
+    size_t depth() const
+    {
+      return stack_.size() - 1;
+    }
+
+    bool entering() const
+    {
+      return entering_;
+    }
+
+    // Skips the children of the node that has just been entered. It's still
+    // left as usual.
+    void skip()
+    {
+      stack_.back().next = std::numeric_limits<size_t>::max();
+    }
+  };
+
+  inline void NodeDef::mark_dirty_symbols(uint64_t binders)
+  {
+    Walk walk(this);
+
+    // The table that the children of each node on the stack bind into.
+    std::vector<NodeDef*> inner;
+
+    while (walk.next())
+    {
+      auto node = walk.node();
+
+      if (!walk.entering())
+      {
+        inner.pop_back();
+        continue;
+      }
+
+      auto scope = inner.empty() ? nullptr : inner.back();
+      inner.push_back(node->symtab_ ? node : scope);
+
+      if (
+        (node->type_ == Error) ||
+        ((walk.depth() > 0) && !(node->st_flags_ & st_below)))
+      {
+        walk.skip();
+        continue;
+      }
+
+      if (node->st_flags_ & st_changed)
+      {
+        if (inner.back())
+          inner.back()->symtab_->dirty = true;
+
+        if (node->symtab_ && scope)
+          scope->symtab_->dirty = true;
+      }
+
+      if (node->binds_nothing(binders))
+        walk.skip();
+    }
+  }
+
+  template<typename F>
+  inline bool NodeDef::rebuild_symbols(
+    bool full, F& bind, std::vector<NodeDef*>& failed, uint64_t binders)
+  {
+    Walk walk(this);
+    bool ok = true;
+
+    // Whether the table that the children of each node on the stack bind
+    // into was cleared.
+    std::vector<bool> inner_dirty;
+
+    while (walk.next())
+    {
+      auto node = walk.node();
+
+      if (!walk.entering())
+      {
+        inner_dirty.pop_back();
+        continue;
+      }
+
+      auto scope_dirty = !inner_dirty.empty() && inner_dirty.back();
+
+      if (
+        (node->type_ == Error) ||
+        ((walk.depth() > 0) && !full && !scope_dirty &&
+         !(node->st_flags_ & st_below)))
+      {
+        inner_dirty.push_back(false);
+        walk.skip();
+        continue;
+      }
+
+      auto& symtab = node->symtab_;
+      auto dirty = symtab && (full || symtab->dirty);
+
+      if (dirty)
+      {
+        symtab->clear();
+        symtab->dirty = false;
+      }
+
+      if ((full || scope_dirty) && !bind(Node(node)))
+      {
+        ok = false;
+
+        if (auto st = node->scope())
+          failed.push_back(st.get());
+      }
+
+      inner_dirty.push_back(symtab ? dirty : scope_dirty);
+      node->st_flags_ = 0;
+
+      if (node->binds_nothing(binders))
+        walk.skip();
+    }
+
+    return ok;
+  }
+
+  inline void NodeDef::set_location(const Location& loc)
+  {
+    Walk walk(this);
+
+    while (walk.next())
+    {
+      auto node = walk.node();
+
+      if (!walk.entering())
+      {
+        if (loc.source_id != 0)
+          node->unlocated_ = false;
+      }
+      else if (!node->unlocated_)
+      {
+        walk.skip();
+      }
+      else if (node->location_.source_id == 0)
+      {
+        node->unshare();
+        node->location_ = loc;
+        node->retain_source();
+        node->symbol_ = 0;
+        node->invalidate_hash();
+      }
+    }
+  }
+
+  inline Node NodeDef::clone()
+  {
+    Walk walk(this, true);
+    Node result;
+
+    // The copies of the nodes on the stack.
+    std::vector<NodeDef*> copies;
+
+    while (walk.next())
+    {
+      if (!walk.entering())
+      {
+        // The copy is complete, so it has the same hash as the original.
+        copies.back()->hash_ = walk.node()->hash_;
+        copies.pop_back();
+        continue;
+      }
+
+      auto node = walk.node();
+      auto copy = create(node->type_, node->location_);
+
+      if (copies.empty())
+        result = copy;
+      else
+        copies.back()->push_back(copy);
+
+      copies.push_back(copy.get());
+    }
+
+    return result;
+  }
+
+  inline Node NodeDef::lazy_clone()
+  {
+    auto source = content();
+    auto copy = create(type_, location_);
+    copy->hash_ = hash_;
+
+    if (source->children.empty())
+      return copy;
+
+    // The copy's children are the same as the source's, so it has the same
+    // summary. Like a node built by push_back, it's marked as changed.
+    copy->lazy_ = true;
+    copy->summary_ = summary_;
+    copy->unlocated_ = unlocated_;
+    copy->st_flags_ = st_changed | st_below;
+    copy->children.push_back(Node(source));
+
+    if (!source->views_)
+      source->views_ = std::make_unique<std::unordered_set<NodeDef*>>();
+
+    source->views_->insert(copy.get());
+    detail::lazy_views.fetch_add(1, std::memory_order_relaxed);
+    return copy;
+  }
+
+  inline bool NodeDef::exclusive() const
+  {
+    // Count the references from symbol tables, and check the reference count
+    // of each node once they're all known.
+    std::unordered_map<const NodeDef*, size_t> refs;
+    std::vector<const NodeDef*> nodes{this};
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+      auto node = nodes[i];
+
+      if (node->lazy_ || node->views_)
+        return false;
+
+      if (node->symtab_)
+      {
+        for (auto& entry : node->symtab_->entries)
+        {
+          for (auto& def : entry.nodes)
+            refs[def.get()]++;
+        }
+
+        for (auto& include : node->symtab_->includes)
+          refs[include.get()]++;
+      }
+
+      for (auto& child : node->children)
+        nodes.push_back(child.get());
+    }
+
+    for (auto node : nodes)
+    {
+      size_t expect = 1;
+
+      if (!refs.empty())
+      {
+        auto it = refs.find(node);
+
+        if (it != refs.end())
+        {
+          expect += it->second;
+          refs.erase(it);
+        }
+      }
+
+      if (node->refcount_ != expect)
+        return false;
+    }
+
+    // Anything left is a node outside the subtree.
+    return refs.empty();
+  }
+
+  inline void NodeDef::expand()
+  {
+    Node source = children.front();
+    children.clear();
+    lazy_ = false;
+    release_view(source.get());
+
+    for (auto& child : source->children)
+    {
+      auto copy = child->lazy_clone();
+      copy->parent_ = this;
+      copy->index_ = static_cast<uint32_t>(children.size());
+      copy->st_flags_ = st_changed | st_below;
+      children.push_back(copy);
+    }
+
+    // The new children haven't been bound into symbol tables yet. The hash is
+    // unchanged.
+    st_flags_ |= st_changed;
+    changed_below();
+  }
+
+  inline void NodeDef::unshare_path()
+  {
+    // Lazy clones elsewhere don't mean this tree has any, so look for one on
+    // the way to the root before building the path.
+    auto viewed = this;
+
+    while (viewed && !viewed->views_)
+      viewed = viewed->parent_;
+
+    if (!viewed)
+      return;
+
+    std::vector<NodeDef*> path;
+
+    for (auto p = this; p; p = p->parent_)
+      path.push_back(p);
+
+    // Expanding the last clone of the root could otherwise free it.
+    Node root(path.back());
+    std::reverse(path.begin(), path.end());
+
+    for (size_t i = 0; i < path.size(); i++)
+    {
+      // Expand each clone of this node down the path to this node. The
+      // clones made along the way are expanded in turn, so no node on the
+      // path is left with clones that share its children. Expanding a clone
+      // takes it off its source's list.
+      while (path[i]->views_)
+      {
+        auto view = *path[i]->views_->begin();
+
+        for (size_t j = i;; j++)
+        {
+          if (view->lazy_)
+            view->expand();
+
+          if (j + 1 == path.size())
+            break;
+
+          auto k = path[j]->child_index(path[j + 1]);
+
+          if (k >= view->children.size())
+            break;
+
+          view = view->children[k].get();
+        }
+      }
+    }
+  }
+
+  inline uint64_t NodeDef::hash()
+  {
+    Walk walk(this, true);
+
+    while (walk.next())
+    {
+      auto node = walk.node();
+
+      // Each node below a node with a hash also has one.
+      if (node->hash_)
+      {
+        if (walk.entering())
+          walk.skip();
+
+        continue;
+      }
+
+      if (walk.entering())
+        continue;
+
+      auto text = (node->type_ & flag::print) ? node->location_.view() :
+                                                std::string_view();
+      auto& kids = node->content()->children;
+      auto h = detail::hash_node(node->type_, text, kids.size());
+
+      for (auto& child : kids)
+        h = detail::hash_value(h, child->hash_);
+
+      node->hash_ = detail::hash_fold(h);
+    }
+
+    return hash_;
+  }
+
+  inline bool NodeDef::equals(Node& node)
+  {
+    // The walks stay in step as long as each pair of nodes has the same
+    // number of children.
+    Walk walk1(this, true);
+    Walk walk2(node, true);
+
+    while (walk1.next() && walk2.next())
+    {
+      if (!walk1.entering())
+        continue;
+
+      auto p = walk1.node();
+      auto q = walk2.node();
+
+      // Hashes aren't computed here, but if both are known and differ, the
+      // subtrees differ.
+      if (p->hash_ && q->hash_ && (p->hash_ != q->hash_))
+        return false;
+
+      if (
+        (p->type_ != q->type_) ||
+        ((p->type_ & flag::print) && !(p->location_ == q->location_)) ||
+        (p->size() != q->size()))
+        return false;
+    }
+
+    return true;
+  }
+
+  inline void NodeDef::str(std::ostream& out, size_t level) const
+  {
+    // The walk doesn't change the tree.
+    Walk walk(const_cast<NodeDef*>(this), true);
+
+    while (walk.next())
+    {
+      if (!walk.entering())
+      {
+        out << ")";
+        continue;
+      }
+
+      auto node = walk.node();
+      auto depth = level + walk.depth();
+
+      if (walk.depth() > 0)
+        out << std::endl;
+
+      out << indent(depth) << "(" << node->type_.str();
+
+      if (node->type_ & flag::print)
+        out << " " << node->location_.view().size() << ":"
+            << node->location_.view();
+
+      if (node->symtab_)
+      {
+        out << std::endl;
+        node->symtab_->str(out, depth + 1);
+      }
+    }
+  }
+
+  inline bool NodeDef::errors(std::ostream& out) const
+  {
+    // The walk doesn't change the tree.
+    Walk walk(const_cast<NodeDef*>(this), true);
+    bool err = false;
+
+    // Whether an error was found below each node on the stack.
+    std::vector<bool> below;
+
+    while (walk.next())
+    {
+      if (walk.entering())
+      {
+        below.push_back(false);
+        continue;
+      }
+
+      auto node = walk.node();
+      err = below.back();
+      below.pop_back();
+
+      // If an error wraps another error, print only the innermost error.
+      if (!err && (node->type_ == Error))
+      {
+        for (auto& child : node->content()->children)
+        {
+          if (child->type() == ErrorMsg)
+            out << child->location().view() << std::endl;
+          else
+            out << child->location().origin_linecol() << std::endl
+                << child->location().str();
+        }
+
+        // Trailing blank line.
+        out << std::endl;
+        err = true;
+      }
+
+      if (err && !below.empty())
+        below.back() = true;
+    }
+
+    return err;
+  }
+
+  // An optional cache for `lookup`, for callers that look up the same names
+  // many times between symbol table rebuilds. Results are keyed by the
+  // innermost scope and the symbol, and are discarded when the version of any
+  // scope they were computed from has changed, or the scope has moved. What's
+  // cached doesn't depend on where the reference is: definitions in a
+  // flag::defbeforeuse scope are kept along with the scopes beyond them, and
+  // are checked against the reference on each call.
+  //
+  // The cache holds references to the definitions it has returned, which
+  // keeps them alive after they leave the tree. Reference counts aren't
+  // atomic, so call `clear` before the tree is dropped or passed to
+  // `reclaim`, and don't keep a cache beyond the tree it was used on.
+  class LookupCache
+  {
+  private:
+    struct Scope
+    {
+      NodeDef* st;
+      uint64_t version;
+      // The end of this scope's nodes in `nodes`.
+      size_t end;
+    };
+
+    struct Result
+    {
+      std::vector<Scope> scopes;
+      Nodes nodes;
+      // Whether each node is only found from references it precedes.
+      std::vector<bool> ordered;
+      bool any_ordered = false;
+    };
+
+    struct Hash
+    {
+      size_t operator()(const std::pair<NodeDef*, uint32_t>& key) const
+      {
+        return std::hash<NodeDef*>()(key.first) ^
+          (size_t(key.second) * 0x9E3779B97F4A7C15ull);
+      }
+    };
+
+    std::unordered_map<std::pair<NodeDef*, uint32_t>, Result, Hash> cache;
+    Nodes filtered;
+
+    static bool valid(const Result& result, Node st)
+    {
+      for (auto& scope : result.scopes)
+      {
+        if (
+          !st || (st.get() != scope.st) ||
+          (st->symtab_version() != scope.version))
+          return false;
+
+        st = st->scope();
+      }
+
+      return true;
+    }
+
+    Result* find(Node node)
+    {
+      auto st = node->scope();
+
+      if (!st)
+        return nullptr;
+
+      auto sym = node->symbol();
+      auto& result = cache[{st.get(), sym}];
+
+      if (!result.scopes.empty() && valid(result, st))
+        return &result;
+
+      result.scopes.clear();
+      result.nodes.clear();
+      result.ordered.clear();
+      result.any_ordered = false;
+
+      // A scope only stops the search for every reference if it has a
+      // shadowing node that isn't ordered.
+      for (auto p = st; p; p = p->scope())
+      {
+        bool shadowing = false;
+
+        p->lookup_here(sym, [&](const Node& n, bool ordered) {
+          result.nodes.push_back(n);
+          result.ordered.push_back(ordered);
+          result.any_ordered = result.any_ordered || ordered;
+          shadowing = shadowing || (!ordered && (n->type() & flag::shadowing));
+          return true;
+        });
+
+        result.scopes.push_back(
+          {p.get(), p->symtab_version(), result.nodes.size()});
+
+        if (shadowing)
+          break;
+      }
+
+      return &result;
+    }
+
+  public:
+    // Calls `f` on each node that `node->lookup()` would return, in the same
+    // order. If `f` returns false, no more nodes are visited.
+    template<typename F>
+    void lookup_each(Node node, F&& f)
+    {
+      auto result = find(node);
+
+      if (!result)
+        return;
+
+      size_t i = 0;
+
+      for (auto& scope : result->scopes)
+      {
+        bool shadowing = false;
+
+        for (; i < scope.end; i++)
+        {
+          auto& n = result->nodes[i];
+
+          if (result->ordered[i] && !n->precedes(node.get()))
+            continue;
+
+          shadowing = shadowing || (n->type() & flag::shadowing);
+
+          if (!f(n))
+            return;
+        }
+
+        if (shadowing)
+          return;
+      }
+    }
+
+    const Nodes& lookup(Node node)
+    {
+      auto result = find(node);
+
+      if (!result)
+        return filtered = {};
+
+      // With nothing to check against the reference, the cached nodes are
+      // exactly what lookup returns.
+      if (!result->any_ordered)
+        return result->nodes;
+
+      filtered.clear();
+      lookup_each(node, [&](const Node& n) {
+        filtered.push_back(n);
+        return true;
+      });
+
+      return filtered;
+    }
+
+    void clear()
+    {
+      cache.clear();
+      filtered.clear();
+    }
+  };
+
+  // A hash-consing table for leaves that don't change once they're made,
+  // such as literals and identifiers. Each distinct leaf, by type and by text
+  // if the type has flag::print, has a canonical node, so equal leaves can be
+  // compared by identity and used as keys. A node can only be in one place in
+  // a tree, so `make` returns a new leaf that shares the canonical leaf's
+  // location instead, which saves copying the text. This isn't thread-safe.
+  class HashCons
+  {
+  private:
+    std::unordered_map<uint64_t, Nodes> table;
+
+    Node* find(const Token& type, std::string_view text, uint64_t hash)
+    {
+      auto it = table.find(hash);
+
+      if (it == table.end())
+        return nullptr;
+
+      for (auto& node : it->second)
+      {
+        if (
+          (node->type() == type) &&
+          (!(type & flag::print) || (node->location().view() == text)))
+          return &node;
+      }
+
+      return nullptr;
+    }
+
+    static uint64_t leaf_hash(const Token& type, std::string_view text)
+    {
+      // The same as the hash of the leaf.
+      return detail::hash_fold(detail::hash_node(type, text, 0));
+    }
+
+  public:
+    // Returns the canonical leaf equal to `leaf`, which becomes canonical if
+    // there isn't one yet.
+    Node intern(Node leaf)
+    {
+      if (!leaf->empty())
+        throw std::runtime_error("Only leaves can be hash-consed");
+
+      auto& type = leaf->type();
+      auto text = leaf->location().view();
+      auto hash = leaf_hash(type, text);
+
+      if (auto node = find(type, text, hash))
+        return *node;
+
+      table[hash].push_back(leaf);
+      return leaf;
+    }
+
+    // Returns a new leaf equal to the canonical leaf with this type and text.
+    Node make(const Token& type, std::string_view text)
+    {
+      auto hash = leaf_hash(type, text);
+      auto node = find(type, text, hash);
+
+      if (!node)
+      {
+        auto& bucket = table[hash];
+        bucket.push_back(NodeDef::create(type, Location(std::string(text))));
+        node = &bucket.back();
+      }
+
+      return NodeDef::create(type, (*node)->location());
+    }
+
+    size_t size() const
+    {
+      size_t count = 0;
+
+      for (auto& [hash, nodes] : table)
+        count += nodes.size();
+
+      return count;
+    }
+  };
+
   inline TokenDef::operator Node() const
   {
     return NodeDef::create(Token(*this));
@@ -627,9 +2261,10 @@ namespace trieste
   {
     out << indent(level) << "{";
 
-    for (auto& [loc, sym] : symbols)
+    for (auto entry : sorted())
     {
-      out << std::endl << indent(level + 1) << loc.view() << " =";
+      auto& sym = entry->nodes;
+      out << std::endl << indent(level + 1) << entry->loc.view() << " =";
 
       if (sym.size() == 1)
       {
@@ -4,6 +4,7 @@
 
 #include "parse.h"
 #include "pass.h"
+#include "reclaim.h"
 #include "regex.h"
 #include "wf.h"
 
@@ -83,6 +84,15 @@ namespace trieste
       std::filesystem::path output;
       build->add_option("-o,--output", output, "Output path.");
 
+      size_t jobs = 1;
+      build
+        ->add_option("-j,--jobs", jobs, "Parse files on this many threads.")
+        ->check(CLI::PositiveNumber);
+
+      bool no_teardown = false;
+      build->add_flag(
+        "--no-teardown", no_teardown, "Don't free the AST before exiting.");
+
       // Custom command line options when building.
       if (options)
         options->configure(*build);
@@ -115,6 +125,13 @@ namespace trieste
       bool test_failfast = false;
       test->add_flag("-f,--failfast", test_failfast, "Stop on first failure");
 
+      bool test_reclaim = false;
+      test->add_flag(
+        "--reclaim",
+        test_reclaim,
+        "Free each tree on a background thread. Only safe if no pass keeps "
+        "references to nodes after it runs.");
+
       try
       {
         app.parse(argc, argv);
@@ -195,6 +212,8 @@ namespace trieste
         else
         {
           // Parse the source path.
+          parser.jobs(jobs);
+
           if (std::filesystem::exists(path))
             ast = parser.parse(path);
           else
@@ -276,6 +295,11 @@ namespace trieste
                     << std::endl;
           ret = -1;
         }
+
+        // Freeing a large AST touches every node, and the process is about to
+        // exit anyway.
+        if (no_teardown)
+          ast.detach();
       }
       else if (*test)
       {
@@ -349,6 +373,15 @@ namespace trieste
               if (test_failfast)
                 return ret;
             }
+
+            // This tree is no longer needed. If asked to, free it while the
+            // next one is generated and tested. Whether anything else still
+            // refers to its nodes isn't checked, so this is up to the user.
+            if (test_reclaim)
+            {
+              ast = nullptr;
+              reclaim(std::move(new_ast));
+            }
           }
 
           wf::pop_front();
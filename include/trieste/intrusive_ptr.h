@@ -0,0 +1,156 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <utility>
+
+namespace trieste
+{
+  // A smart pointer to an object that carries its own reference count. The
+  // pointee must provide `intrusive_inc_ref()` and `intrusive_dec_ref()`, and
+  // is responsible for freeing itself when the count drops to zero. Whether
+  // the count is atomic is up to the pointee: a node's isn't, so a node
+  // handle must not be copied or dropped on two threads at once, while a
+  // source's is.
+  template<typename T>
+  class intrusive_ptr
+  {
+  private:
+    T* ptr;
+
+  public:
+    intrusive_ptr() : ptr(nullptr) {}
+
+    intrusive_ptr(std::nullptr_t) : ptr(nullptr) {}
+
+    explicit intrusive_ptr(T* p) : ptr(p)
+    {
+      if (ptr)
+        ptr->intrusive_inc_ref();
+    }
+
+    intrusive_ptr(const intrusive_ptr& that) : ptr(that.ptr)
+    {
+      if (ptr)
+        ptr->intrusive_inc_ref();
+    }
+
+    intrusive_ptr(intrusive_ptr&& that) noexcept : ptr(that.ptr)
+    {
+      that.ptr = nullptr;
+    }
+
+    ~intrusive_ptr()
+    {
+      if (ptr)
+        ptr->intrusive_dec_ref();
+    }
+
+    intrusive_ptr& operator=(const intrusive_ptr& that)
+    {
+      intrusive_ptr(that).swap(*this);
+      return *this;
+    }
+
+    intrusive_ptr& operator=(intrusive_ptr&& that) noexcept
+    {
+      intrusive_ptr(std::move(that)).swap(*this);
+      return *this;
+    }
+
+    intrusive_ptr& operator=(std::nullptr_t)
+    {
+      reset();
+      return *this;
+    }
+
+    void reset()
+    {
+      intrusive_ptr().swap(*this);
+    }
+
+    // Gives up this handle without dropping its reference, so the pointee
+    // won't be freed through it.
+    T* detach()
+    {
+      return std::exchange(ptr, nullptr);
+    }
+
+    void swap(intrusive_ptr& that) noexcept
+    {
+      std::swap(ptr, that.ptr);
+    }
+
+    T* get() const
+    {
+      return ptr;
+    }
+
+    T* operator->() const
+    {
+      return ptr;
+    }
+
+    T& operator*() const
+    {
+      return *ptr;
+    }
+
+    explicit operator bool() const
+    {
+      return ptr != nullptr;
+    }
+
+    bool owner_before(const intrusive_ptr& that) const
+    {
+      // Allows std::owner_less<> to be used as it is with std::shared_ptr.
+      return std::less<T*>()(ptr, that.ptr);
+    }
+  };
+
+  // Comparisons are templates, as they are for std::shared_ptr, so that
+  // implicit conversions to a handle don't make them ambiguous.
+  template<typename T, typename U>
+  inline bool
+  operator==(const intrusive_ptr<T>& lhs, const intrusive_ptr<U>& rhs)
+  {
+    return lhs.get() == rhs.get();
+  }
+
+  template<typename T, typename U>
+  inline bool
+  operator!=(const intrusive_ptr<T>& lhs, const intrusive_ptr<U>& rhs)
+  {
+    return lhs.get() != rhs.get();
+  }
+
+  template<typename T>
+  inline bool operator==(const intrusive_ptr<T>& lhs, std::nullptr_t)
+  {
+    return !lhs;
+  }
+
+  template<typename T>
+  inline bool operator!=(const intrusive_ptr<T>& lhs, std::nullptr_t)
+  {
+    return !!lhs;
+  }
+
+  template<typename T, typename U>
+  inline bool
+  operator<(const intrusive_ptr<T>& lhs, const intrusive_ptr<U>& rhs)
+  {
+    return lhs.owner_before(rhs);
+  }
+}
+
+template<typename T>
+struct std::hash<trieste::intrusive_ptr<T>>
+{
+  size_t operator()(const trieste::intrusive_ptr<T>& p) const noexcept
+  {
+    return std::hash<T*>()(p.get());
+  }
+};
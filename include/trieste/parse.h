@@ -6,8 +6,12 @@
 #include "gen.h"
 #include "regex.h"
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <filesystem>
 #include <functional>
+#include <thread>
 
 namespace trieste
 {
@@ -21,6 +25,7 @@ namespace trieste
     class RuleDef
     {
       friend class trieste::Parse;
+      friend class Mode;
 
     private:
       RE2 regex;
@@ -34,6 +39,43 @@ namespace trieste
 
     using Rule = std::shared_ptr<RuleDef>;
 
+    // The rules for a single parse mode. The rules are also compiled into a
+    // single anchored RE2::Set, so that one scan of the input finds every rule
+    // that can match at the current position, rather than trying each rule's
+    // regex in turn.
+    class Mode
+    {
+      friend class trieste::Parse;
+
+    private:
+      std::string name;
+      std::vector<Rule> rules;
+      std::shared_ptr<RE2::Set> set;
+
+    public:
+      Mode(const std::string& name) : name(name) {}
+
+      void add(const std::initializer_list<Rule> r)
+      {
+        rules.insert(rules.end(), r.begin(), r.end());
+        set =
+          std::make_shared<RE2::Set>(RE2::DefaultOptions, RE2::ANCHOR_START);
+
+        for (auto& rule : rules)
+        {
+          if (set->Add(rule->regex.pattern(), nullptr) < 0)
+          {
+            set = nullptr;
+            return;
+          }
+        }
+
+        // If the set can't be compiled, fall back to trying each rule.
+        if (!set->Compile())
+          set = nullptr;
+      }
+    };
+
     class Make
     {
       friend class trieste::Parse;
@@ -42,6 +84,7 @@ namespace trieste
       Node top;
       Node node;
       std::string mode_;
+      bool mode_changed = false;
       REMatch re_match;
       REIterator re_iterator;
 
@@ -66,6 +109,7 @@ namespace trieste
       void mode(const std::string& next)
       {
         mode_ = next;
+        mode_changed = true;
       }
 
       bool in(const Token& type) const
@@ -104,13 +148,13 @@ namespace trieste
           push(Group);
 
         while (node->parent()->type().in(skip))
-          node = node->parent()->shared_from_this();
+          node = Node(node->parent());
 
         auto p = node->parent();
 
         if (p == type)
         {
-          node = p->shared_from_this();
+          node = Node(p);
         }
         else
         {
@@ -173,7 +217,7 @@ namespace trieste
           if (!node->empty())
             node->extend(node->back()->location());
 
-          node = node->parent()->shared_from_this();
+          node = Node(node->parent());
           return true;
         }
 
@@ -196,7 +240,7 @@ namespace trieste
         {
           node->push_back(make_error(node->location(), "this is unclosed"));
           term();
-          node = node->parent()->shared_from_this();
+          node = Node(node->parent());
           term();
         }
 
@@ -224,8 +268,20 @@ namespace trieste
       std::function<void(const Parse&, const std::filesystem::path&, Node)>;
 
   private:
+    // The files found below a directory when parsing on multiple threads.
+    // The files are a contiguous range of a flat list, so that they can be
+    // parsed in any order and then reassembled in the order they were found.
+    struct Listing
+    {
+      std::filesystem::path dir;
+      std::vector<Listing> dirs;
+      size_t first_file = 0;
+      size_t file_count = 0;
+    };
+
     std::filesystem::path exe;
     depth depth_;
+    size_t jobs_ = 1;
 
     PreF prefile_;
     PreF predir_;
@@ -233,7 +289,8 @@ namespace trieste
     PostF postdir_;
     PostF postparse_;
     detail::ParseEffect done_;
-    std::map<std::string, std::vector<detail::Rule>> rules;
+    std::map<std::string, size_t> mode_ids;
+    std::vector<detail::Mode> modes;
     std::map<Token, GenLocationF> gens;
 
   public:
@@ -242,7 +299,12 @@ namespace trieste
     Parse& operator()(
       const std::string& mode, const std::initializer_list<detail::Rule> r)
     {
-      rules[mode].insert(rules[mode].end(), r.begin(), r.end());
+      auto [it, added] = mode_ids.emplace(mode, modes.size());
+
+      if (added)
+        modes.emplace_back(mode);
+
+      modes[it->second].add(r);
       return *this;
     }
 
@@ -275,6 +337,24 @@ namespace trieste
       exe = std::filesystem::canonical(path);
     }
 
+    size_t jobs() const
+    {
+      return jobs_;
+    }
+
+    // Sets the number of threads used to parse the files in a directory. With
+    // more than one job, the `prefile`, `postfile` and `done` hooks and the
+    // rule effects are called concurrently for different files, so they must
+    // not share unsynchronized state. The `predir` and `postdir` hooks are
+    // still called on the calling thread: every `predir` is called before any
+    // file is parsed, and every `postdir` after all files are parsed, in the
+    // same order as a single-threaded parse. The resulting AST is the same
+    // regardless of the number of jobs.
+    void jobs(size_t n)
+    {
+      jobs_ = std::max(n, size_t(1));
+    }
+
     void prefile(PreF f)
     {
       prefile_ = f;
@@ -307,6 +387,7 @@ namespace trieste
 
     Node parse(const std::filesystem::path path) const
     {
+      detail::SyntheticScope scope;
       auto ast = sub_parse(path);
       auto top = NodeDef::create(Top);
       top->push_back(ast);
@@ -363,33 +444,47 @@ namespace trieste
       auto make = detail::Make(name, token, source);
 
       // Find the start rules.
-      auto find = rules.find("start");
-      if (find == rules.end())
+      auto find = mode_ids.find("start");
+      if (find == mode_ids.end())
         throw std::runtime_error("unknown mode: start");
 
-      auto mode = make.mode_ = find->first;
+      auto mode = &modes[find->second];
+      make.mode_ = mode->name;
+      std::vector<int> candidates;
 
       while (!make.re_iterator.empty())
       {
-        bool matched = false;
+        detail::Rule matched;
 
-        for (auto& rule : find->second)
+        if (mode->set && make.re_iterator.match(*mode->set, candidates))
         {
-          matched = make.re_iterator.consume(rule->regex, make.re_match);
+          // The set reports every rule that matches here, including rules
+          // that only match the empty string. Take the first rule, in
+          // priority order, that the rule's own regex accepts. If no rule
+          // matches, the input here is invalid.
+          std::sort(candidates.begin(), candidates.end());
 
-          if (matched)
+          for (auto i : candidates)
           {
-            rule->effect(make);
+            auto& rule = mode->rules[i];
 
-            if (make.mode_ != mode)
+            if (make.re_iterator.consume(rule->regex, make.re_match))
             {
-              find = rules.find(make.mode_);
-              if (find == rules.end())
-                throw std::runtime_error("unknown mode: " + make.mode_);
-
-              mode = find->first;
+              matched = rule;
+              break;
+            }
+          }
+        }
+        else
+        {
+          // With no set, or if the set couldn't be used, try every rule.
+          for (auto& rule : mode->rules)
+          {
+            if (make.re_iterator.consume(rule->regex, make.re_match))
+            {
+              matched = rule;
+              break;
             }
-            break;
           }
         }
 
@@ -397,6 +492,23 @@ namespace trieste
         {
           make.invalid();
           make.re_iterator.skip();
+          continue;
+        }
+
+        matched->effect(make);
+
+        if (make.mode_changed)
+        {
+          make.mode_changed = false;
+
+          if (make.mode_ != mode->name)
+          {
+            find = mode_ids.find(make.mode_);
+            if (find == mode_ids.end())
+              throw std::runtime_error("unknown mode: " + make.mode_);
+
+            mode = &modes[find->second];
+          }
         }
       }
 
@@ -406,14 +518,11 @@ namespace trieste
       return make.done();
     }
 
-    Node parse_directory(const std::filesystem::path& dir) const
+    void list_directory(
+      const std::filesystem::path& dir,
+      std::set<std::filesystem::path>& dirs,
+      std::set<std::filesystem::path>& files) const
     {
-      if (predir_ && !predir_(*this, dir))
-        return {};
-
-      std::set<std::filesystem::path> dirs;
-      std::set<std::filesystem::path> files;
-
       for (const auto& entry : std::filesystem::directory_iterator(dir))
       {
         if (
@@ -427,6 +536,19 @@ namespace trieste
           files.insert(entry.path());
         }
       }
+    }
+
+    Node parse_directory(const std::filesystem::path& dir) const
+    {
+      if (jobs_ > 1)
+        return parse_directory_parallel(dir);
+
+      if (predir_ && !predir_(*this, dir))
+        return {};
+
+      std::set<std::filesystem::path> dirs;
+      std::set<std::filesystem::path> files;
+      list_directory(dir, dirs, files);
 
       auto top = NodeDef::create(Directory, {dir.stem().string()});
 
@@ -444,6 +566,104 @@ namespace trieste
 
       return top;
     }
+
+    Node parse_directory_parallel(const std::filesystem::path& dir) const
+    {
+      // Find every file first, so that the work can be spread over all of
+      // them rather than one directory at a time.
+      Listing listing;
+      std::vector<std::filesystem::path> files;
+
+      if (!find_files(dir, listing, files))
+        return {};
+
+      std::vector<Node> asts(files.size());
+      std::vector<std::exception_ptr> errors(files.size());
+      std::atomic<size_t> next = 0;
+
+      auto work = [&]() {
+        size_t i;
+
+        while ((i = next.fetch_add(1, std::memory_order_relaxed)) <
+               files.size())
+        {
+          try
+          {
+            asts[i] = parse_file(files[i]);
+          }
+          catch (...)
+          {
+            errors[i] = std::current_exception();
+          }
+        }
+      };
+
+      std::vector<std::thread> threads;
+
+      for (size_t i = 1; i < std::min(jobs_, files.size()); i++)
+        threads.emplace_back(work);
+
+      work();
+
+      for (auto& thread : threads)
+        thread.join();
+
+      // Report the error from the first file in order, as a single-threaded
+      // parse would.
+      for (auto& error : errors)
+      {
+        if (error)
+          std::rethrow_exception(error);
+      }
+
+      return assemble(listing, asts);
+    }
+
+    bool find_files(
+      const std::filesystem::path& dir,
+      Listing& listing,
+      std::vector<std::filesystem::path>& found) const
+    {
+      if (predir_ && !predir_(*this, dir))
+        return false;
+
+      std::set<std::filesystem::path> dirs;
+      std::set<std::filesystem::path> files;
+      list_directory(dir, dirs, files);
+      listing.dir = dir;
+
+      for (auto& subdir : dirs)
+      {
+        Listing sub;
+
+        if (find_files(subdir, sub, found))
+          listing.dirs.push_back(std::move(sub));
+      }
+
+      listing.first_file = found.size();
+      listing.file_count = files.size();
+      found.insert(found.end(), files.begin(), files.end());
+      return true;
+    }
+
+    Node assemble(const Listing& listing, std::vector<Node>& asts) const
+    {
+      auto top = NodeDef::create(Directory, {listing.dir.stem().string()});
+
+      for (auto& sub : listing.dirs)
+        top->push_back(assemble(sub, asts));
+
+      for (size_t i = 0; i < listing.file_count; i++)
+        top->push_back(asts[listing.first_file + i]);
+
+      if (top->empty())
+        return {};
+
+      if (postdir_)
+        postdir_(*this, listing.dir, top);
+
+      return top;
+    }
   };
 
   inline detail::Rule
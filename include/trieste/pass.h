@@ -1,6 +1,7 @@
 #pragma once
 
 #include "rewrite.h"
+#include <unordered_map>
 #include <vector>
 
 namespace trieste
@@ -11,6 +12,13 @@ namespace trieste
     constexpr flag bottomup = 1 << 0;
     constexpr flag topdown = 1 << 1;
     constexpr flag once = 1 << 2;
+    // After the first traversal, only re-examine what a rewrite could have
+    // affected. See PassDef::run.
+    constexpr flag worklist = 1 << 3;
+    // After a rewrite, resume matching only as far back as the longest rule
+    // can reach, rather than from the first child. This gives the same result
+    // as long as every predicate looks only at the nodes it's given.
+    constexpr flag local = 1 << 4;
   };
 
   class PassDef;
@@ -24,23 +32,54 @@ namespace trieste
   private:
     F pre_once;
     F post_once;
-    std::map<Token, F> pre_;
-    std::map<Token, F> post_;
+    // Per-token hooks, indexed by token ID.
+    std::vector<F> pre_;
+    std::vector<F> post_;
     dir::flag direction_;
     std::vector<detail::PatternEffect<Node>> rules_;
 
+    // For each token ID, the rules whose pattern can begin on a node of that
+    // type, in priority order. Tokens with no entry can only begin rules that
+    // can begin on anything, which are in `any_rules_`.
+    std::vector<std::vector<size_t>> dispatch_;
+    std::vector<size_t> any_rules_;
+    // The compiled form of each rule's pattern.
+    std::vector<detail::Program> programs_;
+    // The summary bits of every node type that can begin a rule or has a
+    // hook. A subtree whose summary has none of these is skipped.
+    uint64_t triggers_ = ~uint64_t(0);
+    // How many nodes before a rewrite a rule can begin and still see it, or
+    // detail::unbounded.
+    size_t lookbehind_ = 0;
+
+    // In worklist mode, the nodes whose children have been rewritten, and
+    // the nodes that have been inserted, since the last traversal. This is
+    // kept for each run, so that a pass can run on several trees at once.
+    struct Worklist
+    {
+      std::vector<Node> dirty;
+      std::vector<Node> fresh;
+    };
+
   public:
-    PassDef(dir::flag direction = dir::topdown) : direction_(direction) {}
+    PassDef(dir::flag direction = dir::topdown) : direction_(direction)
+    {
+      prepare();
+    }
 
     PassDef(const std::initializer_list<detail::PatternEffect<Node>>& r)
     : direction_(dir::topdown), rules_(r)
-    {}
+    {
+      prepare();
+    }
 
     PassDef(
       dir::flag direction,
       const std::initializer_list<detail::PatternEffect<Node>>& r)
     : direction_(direction), rules_(r)
-    {}
+    {
+      prepare();
+    }
 
     operator Pass() const
     {
@@ -59,12 +98,20 @@ namespace trieste
 
     void pre(const Token& type, F f)
     {
-      pre_[type] = f;
+      if (type.id() >= pre_.size())
+        pre_.resize(type.id() + 1);
+
+      pre_[type.id()] = f;
+      prepare();
     }
 
     void post(const Token& type, F f)
     {
-      post_[type] = f;
+      if (type.id() >= post_.size())
+        post_.resize(type.id() + 1);
+
+      post_[type.id()] = f;
+      prepare();
     }
 
     template<typename... Ts>
@@ -72,28 +119,46 @@ namespace trieste
     {
       std::vector<detail::PatternEffect<Node>> rules = {r...};
       rules_.insert(rules_.end(), rules.begin(), rules.end());
+      prepare();
     }
 
     void rules(const std::initializer_list<detail::PatternEffect<Node>>& r)
     {
       rules_.insert(rules_.end(), r.begin(), r.end());
+      prepare();
     }
 
-    std::tuple<Node, size_t, size_t> run(Node node)
+    // The dispatch tables are built whenever rules or hooks are added, so
+    // running a pass doesn't change it, and a pass can run on several threads
+    // at once as long as its rules and hooks can.
+    std::tuple<Node, size_t, size_t> run(Node node) const
     {
       size_t changes = 0;
       size_t changes_sum = 0;
       size_t count = 0;
+      detail::SyntheticScope scope;
+      Worklist work;
 
       if (pre_once)
         changes_sum += pre_once(node);
 
       // Because apply runs over child nodes, the top node is never visited.
+      //
+      // In worklist mode, only the first iteration traverses the whole tree.
+      // After that, an iteration applies the pass to each node inserted by a
+      // rewrite, and re-matches the children of each node that had children
+      // rewritten, along with its ancestors. This reaches the same fixed point
+      // as long as the rules are confluent and a match depends only on the
+      // matched nodes, their descendants, and the types of their ancestors.
+      // Hooks are only called on nodes that are traversed.
       do
       {
-        changes = apply(node);
+        if (flag(dir::worklist) && (count > 0))
+          changes = apply_worklist(node, work);
+        else
+          changes = apply(node, work);
 
-        auto lifted = lift(node);
+        auto lifted = lift(node, work);
         if (!lifted.empty())
           throw std::runtime_error("lifted nodes with no destination");
 
@@ -102,7 +167,7 @@ namespace trieste
 
         if (flag(dir::once))
           break;
-      } while (changes > 0);
+      } while ((changes > 0) || !work.dirty.empty() || !work.fresh.empty());
 
       if (post_once)
         changes_sum += post_once(node);
@@ -116,10 +181,68 @@ namespace trieste
       return (direction_ & f) != 0;
     }
 
-    size_t match_children(const Node& node)
+    void prepare()
+    {
+      std::vector<detail::FirstSet> firsts;
+      firsts.reserve(rules_.size());
+      any_rules_.clear();
+      programs_.reserve(rules_.size());
+      lookbehind_ = 0;
+
+      // Only the rules added since the last time need compiling.
+      for (size_t i = programs_.size(); i < rules_.size(); i++)
+        programs_.push_back(rules_[i].first.compile());
+
+      for (size_t i = 0; i < rules_.size(); i++)
+      {
+        firsts.push_back(rules_[i].first.first_set());
+
+        // A rule that can look at `width` nodes can see a rewrite from up to
+        // `width - 1` nodes before it.
+        auto width = rules_[i].first.width();
+
+        if (width == detail::unbounded)
+          lookbehind_ = detail::unbounded;
+        else if (width > 0)
+          lookbehind_ = std::max(lookbehind_, width - 1);
+
+        if (firsts.back().any)
+          any_rules_.push_back(i);
+      }
+
+      dispatch_.assign(detail::token_count(), {});
+
+      triggers_ = any_rules_.empty() ? 0 : ~uint64_t(0);
+
+      for (size_t id = 0; id < dispatch_.size(); id++)
+      {
+        Token type = *detail::token_defs()[id];
+
+        for (size_t i = 0; i < rules_.size(); i++)
+        {
+          if (firsts[i].any || type.in(firsts[i].tokens))
+            dispatch_[id].push_back(i);
+        }
+
+        if (
+          !dispatch_[id].empty() || ((id < pre_.size()) && pre_[id]) ||
+          ((id < post_.size()) && post_[id]))
+          triggers_ |= type.summary_bit();
+      }
+    }
+
+    const std::vector<size_t>& rules_for(const Token& type) const
+    {
+      auto id = type.id();
+      return (id < dispatch_.size()) ? dispatch_[id] : any_rules_;
+    }
+
+    size_t match_children(const Node& node, Worklist& work) const
     {
       size_t changes = 0;
       auto it = node->begin();
+      // One match is reused for every attempt at this level.
+      auto match = Match(node);
       // Perform matching at this level
       while (it != node->end())
       {
@@ -132,12 +255,14 @@ namespace trieste
 
         ptrdiff_t replaced = -1;
 
-        for (auto& rule : rules_)
+        // Only try the rules that can begin on this node, in priority order.
+        for (auto i : rules_for((*it)->type()))
         {
-          auto match = Match(node);
+          auto& rule = rules_[i];
           auto start = it;
+          match.reset(node);
 
-          if (rule.first.match(it, node->end(), match))
+          if (programs_[i].match(it, node->end(), match))
           {
             // Replace [start, it) with whatever the rule builds.
             auto replace = rule.second(match);
@@ -150,8 +275,8 @@ namespace trieste
 
             auto loc = (*start)->location();
 
-            for (auto i = start + 1; i < it; ++i)
-              loc = loc * (*i)->location();
+            for (auto j = start + 1; j < it; ++j)
+              loc = loc * (*j)->location();
 
             it = node->erase(start, it);
 
@@ -178,6 +303,12 @@ namespace trieste
               it = node->insert(it, replace);
             }
 
+            if (flag(dir::worklist))
+            {
+              work.dirty.push_back(node);
+              work.fresh.insert(work.fresh.end(), it, it + replaced);
+            }
+
             changes += replaced;
             break;
           }
@@ -191,8 +322,14 @@ namespace trieste
         }
         else if (replaced >= 0)
         {
-          // If we did something, reexamine from the beginning.
-          it = node->begin();
+          // If we did something, reexamine from the beginning. In local mode,
+          // every rule has already failed at each node before `lookbehind_`
+          // nodes ahead of the rewrite, and those attempts didn't look far
+          // enough to see it, so start there instead.
+          if (flag(dir::local) && (lookbehind_ != detail::unbounded))
+            it = node->rewind(it, lookbehind_);
+          else
+            it = node->begin();
         }
         else
         {
@@ -204,7 +341,7 @@ namespace trieste
       return changes;
     }
 
-    size_t apply(Node root)
+    size_t apply(Node root, Worklist& work) const
     {
       size_t changes = 0;
 
@@ -213,21 +350,22 @@ namespace trieste
       auto add = [&](const Node& node) {
         if (node->type().in({Error, Lift}))
           return;
-        auto pre_f = pre_.find(node->type());
-        if (pre_f != pre_.end())
-          changes += pre_f->second(node);
+        auto id = node->type().id();
+        if ((id < pre_.size()) && pre_[id])
+          changes += pre_[id](node);
         if (flag(dir::topdown))
-          changes += match_children(node);
+          changes += match_children(node, work);
         path.push_back({node, node->begin()});
       };
 
       auto remove = [&]() {
         Node& node = path.back().first;
         if (flag(dir::bottomup))
-          changes += match_children(node);
-        auto post_f = post_.find(node->type());
-        if (post_f != post_.end())
-          changes += post_f->second(node);
+          changes += match_children(node, work);
+        auto id = node->type().id();
+        if ((id < post_.size()) && post_[id])
+          changes += post_[id](node);
+        node->refresh_summary();
         path.pop_back();
       };
 
@@ -239,7 +377,10 @@ namespace trieste
         {
           Node curr = *it;
           it++;
-          add(curr);
+
+          // Skip subtrees that contain nothing this pass can act on.
+          if (curr->summary() & triggers_)
+            add(curr);
         }
         else
         {
@@ -250,42 +391,165 @@ namespace trieste
       return changes;
     }
 
-    Nodes lift(Node node)
+    size_t apply_worklist(const Node& root, Worklist& work) const
     {
-      Nodes uplift;
-      auto it = node->begin();
+      size_t changes = 0;
+      auto dirty = std::move(work.dirty);
+      auto fresh = std::move(work.fresh);
+      work.dirty.clear();
+      work.fresh.clear();
+
+      // A node that has been removed from the tree can be skipped.
+      auto attached = [&](NodeDef* node) {
+        while (node && (node != root.get()))
+          node = node->parent();
+        return node != nullptr;
+      };
 
-      while (it != node->end())
+      // Apply the pass to every inserted subtree. This only changes nodes
+      // below each inserted node, which may remove later entries.
+      for (auto& node : fresh)
+      {
+        if (attached(node.get()))
+          changes += apply(node, work);
+      }
+
+      // Re-match the children of each rewritten node and of its ancestors,
+      // as patterns can look into children. Deeper nodes go first, so that
+      // their rewrites are seen when matching at their ancestors. As this
+      // only changes nodes below each node, no later entry is removed.
+      std::unordered_map<NodeDef*, size_t> depth;
+      std::vector<std::pair<size_t, NodeDef*>> visit;
+      std::vector<NodeDef*> path;
+      depth[root.get()] = 0;
+
+      for (auto& node : dirty)
       {
-        bool advance = true;
-        auto lifted = lift(*it);
+        auto p = node.get();
+        path.clear();
 
-        if (*it == Lift)
+        while (p && !depth.contains(p))
         {
-          lifted.insert(lifted.begin(), *it);
-          it = node->erase(it, it + 1);
-          advance = false;
+          path.push_back(p);
+          p = p->parent();
         }
 
-        for (auto& lnode : lifted)
+        if (!p)
+          continue;
+
+        auto d = depth[p];
+
+        if (visit.empty())
+          visit.push_back({0, root.get()});
+
+        for (auto q = path.rbegin(); q != path.rend(); ++q)
         {
-          if (lnode->front()->type() == node->type())
-          {
-            it = node->insert(it, lnode->begin() + 1, lnode->end());
-            it += lnode->size() - 1;
-            advance = false;
-          }
+          depth[*q] = ++d;
+          visit.push_back({d, *q});
+        }
+      }
+
+      std::stable_sort(visit.begin(), visit.end(), [](auto& a, auto& b) {
+        return a.first > b.first;
+      });
+
+      for (auto& [d, node] : visit)
+      {
+        if (!node->type().in({Error, Lift}))
+          changes += match_children(Node(node), work);
+      }
+
+      return changes;
+    }
+
+    Nodes lift(Node root, Worklist& work) const
+    {
+      // Each frame is a node whose children are being lifted from, the
+      // position of the next child, and the nodes lifted past it so far.
+      struct Frame
+      {
+        Node node;
+        NodeIt it;
+        Nodes uplift;
+      };
+
+      std::vector<Frame> stack;
+      stack.push_back({root, root->begin(), {}});
+
+      while (true)
+      {
+        auto& frame = stack.back();
+        auto& node = frame.node;
+        auto& it = frame.it;
+
+        if (it != node->end())
+        {
+          // Skip subtrees that have no Lift nodes. Otherwise, lift from the
+          // child's children first.
+          if ((*it)->summary() & Token(Lift).summary_bit())
+            stack.push_back({*it, (*it)->begin(), {}});
           else
+            ++it;
+
+          continue;
+        }
+
+        node->refresh_summary();
+        auto lifted = std::move(frame.uplift);
+        stack.pop_back();
+
+        if (stack.empty())
+          return lifted;
+
+        auto& parent = stack.back();
+        place(parent.node, parent.it, lifted, parent.uplift, work);
+      }
+    }
+
+    // Places the nodes lifted out of the child at `it`, or passes them on to
+    // `uplift`, and moves `it` past the child.
+    void place(
+      Node& node,
+      NodeIt& it,
+      Nodes& lifted,
+      Nodes& uplift,
+      Worklist& work) const
+    {
+      bool advance = true;
+
+      if (*it == Lift)
+      {
+        lifted.insert(lifted.begin(), *it);
+        it = node->erase(it, it + 1);
+        advance = false;
+
+        if (flag(dir::worklist))
+          work.dirty.push_back(node);
+      }
+
+      for (auto& lnode : lifted)
+      {
+        if (lnode->front()->type() == node->type())
+        {
+          it = node->insert(it, lnode->begin() + 1, lnode->end());
+
+          if (flag(dir::worklist))
           {
-            uplift.push_back(lnode);
+            work.dirty.push_back(node);
+            work.fresh.insert(work.fresh.end(), it, it + lnode->size() - 1);
           }
-        }
 
-        if (advance)
-          ++it;
+          it += lnode->size() - 1;
+          advance = false;
+        }
+        else
+        {
+          uplift.push_back(lnode);
+        }
       }
 
-      return uplift;
+      if (advance)
+        ++it;
     }
   };
 }
@@ -0,0 +1,112 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "ast.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace trieste
+{
+  // Frees dropped ASTs on a background thread, so that the time spent
+  // freeing every node in a large tree is taken off the critical path. The
+  // thread is started the first time a tree is retired.
+  //
+  // Reference counts aren't atomic, so a retired tree must not share nodes
+  // with anything that is still in use, such as another tree, a LookupCache
+  // or a HashCons, and must not contain or be viewed by lazy clones. This is
+  // up to the caller, as checking it means walking the whole tree, which
+  // would cost most of what freeing it does. Debug builds check it anyway.
+  // Only a root with other handles to it is caught in release builds, and
+  // it's dropped as usual instead. Nothing retires trees unless asked to, and
+  // the Driver only does so in test mode with --reclaim.
+  class Reclaimer
+  {
+  private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    Nodes queue;
+    size_t pending = 0;
+    bool stop = false;
+    std::thread thread;
+
+    Reclaimer() = default;
+
+    void work()
+    {
+      std::unique_lock lock(mutex);
+
+      while (true)
+      {
+        cv.wait(lock, [&] { return stop || !queue.empty(); });
+
+        if (queue.empty())
+          return;
+
+        auto nodes = std::move(queue);
+        queue.clear();
+        lock.unlock();
+        auto count = nodes.size();
+        nodes.clear();
+        lock.lock();
+        pending -= count;
+        cv.notify_all();
+      }
+    }
+
+  public:
+    Reclaimer(const Reclaimer&) = delete;
+
+    ~Reclaimer()
+    {
+      {
+        std::lock_guard lock(mutex);
+        stop = true;
+      }
+
+      cv.notify_all();
+
+      if (thread.joinable())
+        thread.join();
+    }
+
+    static Reclaimer& get()
+    {
+      static Reclaimer reclaimer;
+      return reclaimer;
+    }
+
+    void retire(Node node)
+    {
+      if (!node || !node->unique())
+        return;
+
+      assert(node->exclusive());
+
+      std::lock_guard lock(mutex);
+
+      if (!thread.joinable())
+        thread = std::thread([this] { work(); });
+
+      queue.push_back(std::move(node));
+      pending++;
+      cv.notify_all();
+    }
+
+    // Blocks until every retired tree has been freed.
+    void wait()
+    {
+      std::unique_lock lock(mutex);
+      cv.wait(lock, [&] { return pending == 0; });
+    }
+  };
+
+  // Hands `node` to the reclaimer, leaving it empty.
+  inline void reclaim(Node&& node)
+  {
+    Reclaimer::get().retire(std::move(node));
+  }
+}
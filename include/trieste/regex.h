@@ -5,6 +5,7 @@
 #include "source.h"
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 namespace trieste
 {
@@ -103,6 +104,21 @@ namespace trieste
       return true;
     }
 
+    // Finds the patterns in `set` that match at the current position, which
+    // may be none. Returns false only if the set couldn't be used, such as
+    // when its automaton ran out of memory, in which case the patterns must
+    // be tried one at a time.
+    bool match(const RE2::Set& set, std::vector<int>& indices) const
+    {
+      indices.clear();
+      RE2::Set::ErrorInfo info;
+
+      if (set.Match(sp, &indices, &info))
+        return true;
+
+      return info.kind == RE2::Set::kNoError;
+    }
+
     Location current() const
     {
       return {
@@ -183,7 +199,7 @@ namespace trieste
         if (!parent)
           return ast;
 
-        ast = parent->shared_from_this();
+        ast = Node(parent);
       }
     }
 
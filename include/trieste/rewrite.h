@@ -7,16 +7,69 @@
 #include <cassert>
 #include <functional>
 #include <optional>
+#include <re2/re2.h>
 
 namespace trieste
 {
   class PassDef;
 
+  namespace detail
+  {
+    class Program;
+
+    struct Backtrack
+    {
+      size_t pc;
+      NodeIt it;
+      NodeIt end;
+      size_t frames;
+      size_t mark;
+    };
+  }
+
+  // Captures are stored in a flat table indexed by token ID. A slot is only
+  // valid if its generation is the current one, so `reset` clears every
+  // capture without touching the table. Captures made with `capture` are
+  // recorded in an undo log, so a failed branch can be rolled back to a
+  // `mark`. Once the table and the log have grown, a `Match` can be reused
+  // for any number of attempts without allocating.
   class Match
   {
+    friend class detail::Program;
+
   private:
+    struct Slot
+    {
+      NodeRange range;
+      uint32_t gen = 0;
+    };
+
+    struct Undo
+    {
+      size_t id;
+      Slot slot;
+    };
+
     Node in_node;
-    std::map<Token, NodeRange> captures;
+    std::vector<Slot> slots;
+    std::vector<Undo> undo;
+    uint32_t gen = 1;
+
+    // Scratch space for running a compiled pattern, kept here so that it is
+    // reused between attempts.
+    std::vector<detail::Backtrack> backtrack;
+    std::vector<NodeRange> frames;
+    std::vector<NodeIt> saved;
+
+    Slot& slot(const Token& token)
+    {
+      auto id = token.id();
+
+      if (id >= slots.size())
+        slots.resize(std::max(id + 1, detail::token_count()));
+
+      return slots[id];
+    }
 
   public:
     Match(Node in_node) : in_node(in_node) {}
@@ -26,28 +79,230 @@ namespace trieste
       return in_node->fresh(prefix);
     }
 
+    // Discards all captures, so that this can be used for another attempt.
+    void reset(Node node)
+    {
+      in_node = node;
+      undo.clear();
+
+      if (++gen == 0)
+      {
+        for (auto& s : slots)
+          s.gen = 0;
+
+        gen = 1;
+      }
+    }
+
+    size_t mark() const
+    {
+      return undo.size();
+    }
+
+    // Undoes every capture made since `m` was taken.
+    void rollback(size_t m)
+    {
+      while (undo.size() > m)
+      {
+        auto& u = undo.back();
+        slots[u.id] = u.slot;
+        undo.pop_back();
+      }
+    }
+
+    void capture(const Token& token, const NodeRange& range)
+    {
+      auto& s = slot(token);
+      undo.push_back({token.id(), s});
+      s = {range, gen};
+    }
+
     NodeRange& operator[](const Token& token)
     {
-      return captures[token];
+      auto& s = slot(token);
+
+      if (s.gen != gen)
+        s = {{}, gen};
+
+      return s.range;
     }
 
     Node operator()(const Token& token)
     {
-      auto it = captures.find(token);
-      if ((it != captures.end()) && *it->second.first)
-        return *it->second.first;
+      auto id = token.id();
+
+      if ((id < slots.size()) && (slots[id].gen == gen))
+      {
+        auto& range = slots[id].range;
+        if (*range.first)
+          return *range.first;
+      }
 
       return {};
     }
 
     void operator+=(const Match& that)
     {
-      captures.insert(that.captures.begin(), that.captures.end());
+      for (size_t id = 0; id < that.slots.size(); id++)
+      {
+        if (that.slots[id].gen == that.gen)
+          capture(*detail::token_defs()[id], that.slots[id].range);
+      }
     }
   };
 
   namespace detail
   {
+    // The node types a pattern can begin matching on. If `any` is set, the
+    // pattern may begin on a node of any type.
+    struct FirstSet
+    {
+      TokenSet tokens;
+      bool any = false;
+    };
+
+    class PatternDef;
+    using PatternPtr = std::shared_ptr<PatternDef>;
+
+    inline constexpr size_t unbounded = std::numeric_limits<size_t>::max();
+
+    inline size_t add_width(size_t a, size_t b)
+    {
+      return ((a == unbounded) || (b == unbounded)) ? unbounded : a + b;
+    }
+    using ActionFn = std::function<bool(const NodeRange&)>;
+
+    // A pattern compiled to a flat instruction sequence. This is a PEG
+    // machine: ordered choice pushes a backtrack entry that records where to
+    // resume, and the input position, frame depth, and `Match` mark to
+    // restore.
+    class Program
+    {
+    public:
+      enum class Op : uint8_t
+      {
+        // Consume a node of `type`.
+        Token,
+        // Consume a node of `type` whose text matches `regexes[index]`.
+        Regex,
+        // Consume a node whose type is in `sets[index]`.
+        Set,
+        // Consume a node whose type isn't in `sets[index]`.
+        NotSet,
+        // Consume nodes while their type is in `sets[index]`.
+        Span,
+        // Check the type of the next node is (or, if `any`, isn't) in
+        // `sets[index]`, without consuming it.
+        Peek,
+        // Consume any node.
+        Any,
+        // Fail if there are no nodes left.
+        NotEnd,
+        // Jump to `arg` if there are no nodes left.
+        IfEnd,
+        // Check the parent (or, if `any`, an ancestor) is of `type`.
+        Inside,
+        // Check the parent (or, if `any`, an ancestor) is in `sets[index]`.
+        InsideN,
+        // Check the next node is the first child of its parent.
+        First,
+        // Check there are no nodes left.
+        Last,
+        // Push a backtrack entry that resumes at `arg`.
+        Choice,
+        // Pop a backtrack entry and jump to `arg`.
+        Commit,
+        // Pop a backtrack entry, restore its state, and jump to `arg`.
+        BackCommit,
+        // Pop a backtrack entry and fail.
+        FailTwice,
+        Fail,
+        // Save the current position in slot `arg`.
+        Save,
+        // Capture from slot `arg` to the current position as `type`.
+        Capture,
+        // Match the children of the node saved in slot `arg`.
+        Enter,
+        // Return to the enclosing range.
+        Leave,
+        // Call `actions[index]` on slot `arg` to the current position.
+        Action,
+        // Run a pattern that has no compiled form.
+        Call,
+        Match,
+      };
+
+      struct Instr
+      {
+        Op op;
+        bool any = false;
+        uint32_t arg = 0;
+        uint32_t index = 0;
+        Token type = {};
+      };
+
+    private:
+      PatternPtr root;
+      std::vector<Instr> code;
+      std::vector<const RE2*> regexes;
+      std::vector<TokenSet> sets;
+      std::vector<const ActionFn*> actions;
+      std::vector<const PatternDef*> calls;
+      size_t slots = 0;
+
+    public:
+      Program() = default;
+      Program(PatternPtr pattern);
+
+      bool match(NodeIt& it, NodeIt end, Match& match) const;
+
+      size_t emit(const Instr& instr)
+      {
+        code.push_back(instr);
+        return code.size() - 1;
+      }
+
+      // Points the jump at `at` to the next instruction to be emitted.
+      void patch(size_t at)
+      {
+        code[at].arg = static_cast<uint32_t>(code.size());
+      }
+
+      uint32_t here() const
+      {
+        return static_cast<uint32_t>(code.size());
+      }
+
+      uint32_t slot()
+      {
+        return static_cast<uint32_t>(slots++);
+      }
+
+      uint32_t regex(const RE2* r)
+      {
+        regexes.push_back(r);
+        return static_cast<uint32_t>(regexes.size() - 1);
+      }
+
+      uint32_t set(const TokenSet& s)
+      {
+        sets.push_back(s);
+        return static_cast<uint32_t>(sets.size() - 1);
+      }
+
+      uint32_t action(const ActionFn* a)
+      {
+        actions.push_back(a);
+        return static_cast<uint32_t>(actions.size() - 1);
+      }
+
+      uint32_t call(const PatternDef* p)
+      {
+        calls.push_back(p);
+        return static_cast<uint32_t>(calls.size() - 1);
+      }
+    };
+
     class PatternDef
     {
     public:
@@ -62,9 +317,41 @@ namespace trieste
       {
         return false;
       }
-    };
 
-    using PatternPtr = std::shared_ptr<PatternDef>;
+      // Adds the node types this pattern can begin matching on to `set`, and
+      // returns true if the pattern can succeed without consuming a node, in
+      // which case whatever follows it can also supply the first node. This
+      // must be conservative: the default is that anything can match.
+      virtual bool first_set(FirstSet& set) const
+      {
+        set.any = true;
+        return true;
+      }
+
+      // If this pattern consumes exactly one node, based only on its type, and
+      // captures nothing, adds the types it accepts to `set` and returns true.
+      virtual bool token_set(TokenSet&) const
+      {
+        return false;
+      }
+
+      // An upper bound on how many positions, starting where matching begins,
+      // this pattern can look at, counting a check for the end of the
+      // sequence as looking at a position. Nodes that don't change can't
+      // change the outcome. This must be conservative: the default is that
+      // the pattern can look anywhere.
+      virtual size_t width() const
+      {
+        return unbounded;
+      }
+
+      // Emits instructions that match this pattern. The default calls
+      // `match`, so a pattern without a compiled form still works.
+      virtual void compile(Program& p) const
+      {
+        p.emit({.op = Program::Op::Call, .index = p.call(this)});
+      }
+    };
 
     class Cap : public PatternDef
     {
@@ -79,15 +366,31 @@ namespace trieste
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
         auto begin = it;
-        auto match2 = match;
 
-        if (!pattern->match(it, end, match2))
+        if (!pattern->match(it, end, match))
           return false;
 
-        match += match2;
-        match[name] = {begin, it};
+        match.capture(name, {begin, it});
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        return pattern->first_set(set);
+      }
+
+      size_t width() const override
+      {
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        auto slot = p.slot();
+        p.emit({.op = Program::Op::Save, .arg = slot});
+        pattern->compile(p);
+        p.emit({.op = Program::Op::Capture, .arg = slot, .type = name});
+      }
     };
 
     class Anything : public PatternDef
@@ -103,6 +406,22 @@ namespace trieste
         ++it;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        set.any = true;
+        return false;
+      }
+
+      size_t width() const override
+      {
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit({.op = Program::Op::Any});
+      }
     };
 
     class TokenMatch : public PatternDef
@@ -121,6 +440,28 @@ namespace trieste
         ++it;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        set.tokens.insert(type);
+        return false;
+      }
+
+      size_t width() const override
+      {
+        return 1;
+      }
+
+      bool token_set(TokenSet& set) const override
+      {
+        set.insert(type);
+        return true;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit({.op = Program::Op::Token, .type = type});
+      }
     };
 
     class RegexMatch : public PatternDef
@@ -144,6 +485,23 @@ namespace trieste
         ++it;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        set.tokens.insert(type);
+        return false;
+      }
+
+      size_t width() const override
+      {
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit(
+          {.op = Program::Op::Regex, .index = p.regex(&regex), .type = type});
+      }
     };
 
     class Opt : public PatternDef
@@ -156,13 +514,29 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
-        auto match2 = match;
-
-        if (pattern->match(it, end, match2))
-          match += match2;
+        pattern->match(it, end, match);
+        return true;
+      }
 
+      bool first_set(FirstSet& set) const override
+      {
+        pattern->first_set(set);
         return true;
       }
+
+      size_t width() const override
+      {
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        auto choice = p.emit({.op = Program::Op::Choice});
+        pattern->compile(p);
+        auto commit = p.emit({.op = Program::Op::Commit});
+        p.patch(choice);
+        p.patch(commit);
+      }
     };
 
     class Rep : public PatternDef
@@ -185,6 +559,36 @@ namespace trieste
           ;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        pattern->first_set(set);
+        return true;
+      }
+
+      size_t width() const override
+      {
+        return (pattern->width() == 0) ? 0 : unbounded;
+      }
+
+      void compile(Program& p) const override
+      {
+        TokenSet set;
+
+        if (pattern->token_set(set))
+        {
+          p.emit({.op = Program::Op::Span, .index = p.set(set)});
+          return;
+        }
+
+        auto loop = p.here();
+        auto done = p.emit({.op = Program::Op::IfEnd});
+        auto choice = p.emit({.op = Program::Op::Choice});
+        pattern->compile(p);
+        p.emit({.op = Program::Op::Commit, .arg = loop});
+        p.patch(done);
+        p.patch(choice);
+      }
     };
 
     class Not : public PatternDef
@@ -200,11 +604,12 @@ namespace trieste
         if (it == end)
           return false;
 
-        auto match2 = match;
+        auto m = match.mark();
         auto begin = it;
 
-        if (pattern->match(it, end, match2))
+        if (pattern->match(it, end, match))
         {
+          match.rollback(m);
           it = begin;
           return false;
         }
@@ -212,6 +617,38 @@ namespace trieste
         it = begin + 1;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        // This consumes any node that doesn't match the pattern.
+        set.any = true;
+        return false;
+      }
+
+      size_t width() const override
+      {
+        return std::max(pattern->width(), size_t(1));
+      }
+
+      void compile(Program& p) const override
+      {
+        TokenSet set;
+
+        if (pattern->token_set(set))
+        {
+          p.emit({.op = Program::Op::NotSet, .index = p.set(set)});
+          return;
+        }
+
+        // If the pattern matches, discard the choice and fail. Otherwise,
+        // backtrack and consume a single node.
+        p.emit({.op = Program::Op::NotEnd});
+        auto choice = p.emit({.op = Program::Op::Choice});
+        pattern->compile(p);
+        p.emit({.op = Program::Op::FailTwice});
+        p.patch(choice);
+        p.emit({.op = Program::Op::Any});
+      }
     };
 
     class Seq : public PatternDef
@@ -225,21 +662,38 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
-        auto match2 = match;
+        auto m = match.mark();
         auto begin = it;
 
-        if (!first->match(it, end, match2))
+        if (!first->match(it, end, match))
           return false;
 
-        if (!second->match(it, end, match2))
+        if (!second->match(it, end, match))
         {
+          match.rollback(m);
           it = begin;
           return false;
         }
 
-        match += match2;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        return first->first_set(set) && second->first_set(set);
+      }
+
+      size_t width() const override
+      {
+        // The second pattern starts no further on than the first can look.
+        return add_width(first->width(), second->width());
+      }
+
+      void compile(Program& p) const override
+      {
+        first->compile(p);
+        second->compile(p);
+      }
     };
 
     class Choice : public PatternDef
@@ -254,23 +708,43 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
-        auto match2 = match;
+        return first->match(it, end, match) || second->match(it, end, match);
+      }
 
-        if (first->match(it, end, match2))
-        {
-          match += match2;
-          return true;
-        }
+      bool first_set(FirstSet& set) const override
+      {
+        auto empty1 = first->first_set(set);
+        auto empty2 = second->first_set(set);
+        return empty1 || empty2;
+      }
 
-        auto match3 = match;
+      size_t width() const override
+      {
+        return std::max(first->width(), second->width());
+      }
+
+      bool token_set(TokenSet& set) const override
+      {
+        return first->token_set(set) && second->token_set(set);
+      }
 
-        if (second->match(it, end, match3))
+      void compile(Program& p) const override
+      {
+        // A choice between node types doesn't need to backtrack.
+        TokenSet set;
+
+        if (token_set(set))
         {
-          match += match3;
-          return true;
+          p.emit({.op = Program::Op::Set, .index = p.set(set)});
+          return;
         }
 
-        return false;
+        auto choice = p.emit({.op = Program::Op::Choice});
+        first->compile(p);
+        auto commit = p.emit({.op = Program::Op::Commit});
+        p.patch(choice);
+        second->compile(p);
+        p.patch(commit);
       }
     };
 
@@ -310,16 +784,33 @@ namespace trieste
 
         return false;
       }
+
+      bool first_set(FirstSet&) const override
+      {
+        // This doesn't consume a node.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        // This checks that there is a node here.
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit({.op = Program::Op::Inside, .any = any, .type = type});
+      }
     };
 
     class InsideN : public PatternDef
     {
     private:
-      std::vector<Token> types;
+      TokenSet types;
       bool any;
 
     public:
-      InsideN(const std::vector<Token>& types) : types(types), any(false) {}
+      InsideN(const TokenSet& types) : types(types), any(false) {}
 
       bool custom_rep() override
       {
@@ -348,6 +839,24 @@ namespace trieste
 
         return false;
       }
+
+      bool first_set(FirstSet&) const override
+      {
+        // This doesn't consume a node.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        // This checks that there is a node here.
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit(
+          {.op = Program::Op::InsideN, .any = any, .index = p.set(types)});
+      }
     };
 
     class First : public PatternDef
@@ -367,7 +876,24 @@ namespace trieste
           return false;
 
         auto p = (*it)->parent();
-        return p && (it == p->begin());
+        return p && !p->empty() && (it == &p->front());
+      }
+
+      bool first_set(FirstSet&) const override
+      {
+        // This doesn't consume a node.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        // This checks that there is a node here.
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit({.op = Program::Op::First});
       }
     };
 
@@ -386,6 +912,23 @@ namespace trieste
       {
         return it == end;
       }
+
+      bool first_set(FirstSet&) const override
+      {
+        // This doesn't consume a node.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        // This checks that there is no node here.
+        return 1;
+      }
+
+      void compile(Program& p) const override
+      {
+        p.emit({.op = Program::Op::Last});
+      }
     };
 
     class Children : public PatternDef
@@ -401,24 +944,46 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
-        auto match2 = match;
+        auto m = match.mark();
         auto begin = it;
 
-        if (!pattern->match(it, end, match2))
+        if (!pattern->match(it, end, match))
           return false;
 
         auto it2 = (*begin)->begin();
         auto end2 = (*begin)->end();
 
-        if (!children->match(it2, end2, match2))
+        if (!children->match(it2, end2, match))
         {
+          match.rollback(m);
           it = begin;
           return false;
         }
 
-        match += match2;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        return pattern->first_set(set);
+      }
+
+      size_t width() const override
+      {
+        // The children are below a node this looks at, so if they change,
+        // that node has been replaced.
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        auto slot = p.slot();
+        p.emit({.op = Program::Op::Save, .arg = slot});
+        pattern->compile(p);
+        p.emit({.op = Program::Op::Enter, .arg = slot});
+        children->compile(p);
+        p.emit({.op = Program::Op::Leave});
+      }
     };
 
     class Pred : public PatternDef
@@ -437,12 +1002,44 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
+        auto m = match.mark();
         auto begin = it;
-        auto match2 = match;
-        bool ok = pattern->match(it, end, match2);
+        bool ok = pattern->match(it, end, match);
+        match.rollback(m);
         it = begin;
         return ok;
       }
+
+      bool first_set(FirstSet&) const override
+      {
+        // This is a lookahead that doesn't consume a node. Treating it as
+        // transparent is conservative.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        TokenSet set;
+
+        if (pattern->token_set(set))
+        {
+          p.emit({.op = Program::Op::Peek, .index = p.set(set)});
+          return;
+        }
+
+        // On success, backtrack to discard the position and any captures.
+        auto choice = p.emit({.op = Program::Op::Choice});
+        pattern->compile(p);
+        auto commit = p.emit({.op = Program::Op::BackCommit});
+        p.patch(choice);
+        p.emit({.op = Program::Op::Fail});
+        p.patch(commit);
+      }
     };
 
     class NegPred : public PatternDef
@@ -461,15 +1058,45 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
+        auto m = match.mark();
         auto begin = it;
-        auto match2 = match;
-        bool ok = pattern->match(it, end, match2);
+        bool ok = pattern->match(it, end, match);
+        match.rollback(m);
         it = begin;
         return !ok;
       }
-    };
 
-    using ActionFn = std::function<bool(const NodeRange&)>;
+      bool first_set(FirstSet&) const override
+      {
+        // This is a lookahead that doesn't consume a node. Treating it as
+        // transparent is conservative.
+        return true;
+      }
+
+      size_t width() const override
+      {
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        TokenSet set;
+
+        if (pattern->token_set(set))
+        {
+          // This also succeeds if there are no nodes left.
+          auto done = p.emit({.op = Program::Op::IfEnd});
+          p.emit({.op = Program::Op::Peek, .any = true, .index = p.set(set)});
+          p.patch(done);
+          return;
+        }
+
+        auto choice = p.emit({.op = Program::Op::Choice});
+        pattern->compile(p);
+        p.emit({.op = Program::Op::FailTwice});
+        p.patch(choice);
+      }
+    };
 
     class Action : public PatternDef
     {
@@ -484,23 +1111,287 @@ namespace trieste
 
       bool match(NodeIt& it, NodeIt end, Match& match) const override
       {
+        auto m = match.mark();
         auto begin = it;
-        auto match2 = match;
 
-        if (!pattern->match(it, end, match2))
+        if (!pattern->match(it, end, match))
           return false;
 
         if (!action({begin, it}))
         {
+          match.rollback(m);
           it = begin;
           return false;
         }
 
-        match += match2;
         return true;
       }
+
+      bool first_set(FirstSet& set) const override
+      {
+        return pattern->first_set(set);
+      }
+
+      size_t width() const override
+      {
+        // This assumes the action only looks at the nodes it's given.
+        return pattern->width();
+      }
+
+      void compile(Program& p) const override
+      {
+        auto slot = p.slot();
+        p.emit({.op = Program::Op::Save, .arg = slot});
+        pattern->compile(p);
+        p.emit(
+          {.op = Program::Op::Action, .arg = slot, .index = p.action(&action)});
+      }
     };
 
+    inline Program::Program(PatternPtr pattern) : root(pattern)
+    {
+      root->compile(*this);
+      emit({.op = Op::Match});
+    }
+
+    inline bool Program::match(NodeIt& it, NodeIt end, Match& match) const
+    {
+      auto& backtrack = match.backtrack;
+      auto& frames = match.frames;
+      auto& saved = match.saved;
+      backtrack.clear();
+      frames.clear();
+      if (saved.size() < slots)
+        saved.resize(slots);
+
+      auto begin = it;
+      auto m = match.mark();
+      size_t pc = 0;
+
+      while (true)
+      {
+        auto& in = code[pc++];
+        bool ok = true;
+
+        switch (in.op)
+        {
+          case Op::Token:
+          {
+            ok = (it != end) && ((*it)->type() == in.type);
+            if (ok)
+              ++it;
+            break;
+          }
+
+          case Op::Regex:
+          {
+            ok = (it != end) && ((*it)->type() == in.type) &&
+              RE2::FullMatch((*it)->location().view(), *regexes[in.index]);
+            if (ok)
+              ++it;
+            break;
+          }
+
+          case Op::Set:
+          {
+            ok = (it != end) && (*it)->type().in(sets[in.index]);
+            if (ok)
+              ++it;
+            break;
+          }
+
+          case Op::NotSet:
+          {
+            ok = (it != end) && !(*it)->type().in(sets[in.index]);
+            if (ok)
+              ++it;
+            break;
+          }
+
+          case Op::Peek:
+          {
+            ok = (it != end) && ((*it)->type().in(sets[in.index]) != in.any);
+            break;
+          }
+
+          case Op::Span:
+          {
+            while ((it != end) && (*it)->type().in(sets[in.index]))
+              ++it;
+            break;
+          }
+
+          case Op::Any:
+          {
+            ok = it != end;
+            if (ok)
+              ++it;
+            break;
+          }
+
+          case Op::NotEnd:
+          {
+            ok = it != end;
+            break;
+          }
+
+          case Op::IfEnd:
+          {
+            if (it == end)
+              pc = in.arg;
+            break;
+          }
+
+          case Op::Inside:
+          case Op::InsideN:
+          {
+            ok = false;
+
+            if (it == end)
+              break;
+
+            auto p = (*it)->parent();
+
+            while (p)
+            {
+              if (
+                (in.op == Op::Inside) ? (p->type() == in.type) :
+                                        p->type().in(sets[in.index]))
+              {
+                ok = true;
+                break;
+              }
+
+              if (!in.any)
+                break;
+
+              p = p->parent();
+            }
+            break;
+          }
+
+          case Op::First:
+          {
+            if (it == end)
+            {
+              ok = false;
+              break;
+            }
+
+            auto p = (*it)->parent();
+            ok = p && !p->empty() && (it == &p->front());
+            break;
+          }
+
+          case Op::Last:
+          {
+            ok = it == end;
+            break;
+          }
+
+          case Op::Choice:
+          {
+            backtrack.push_back(
+              {in.arg, it, end, frames.size(), match.mark()});
+            break;
+          }
+
+          case Op::Commit:
+          {
+            backtrack.pop_back();
+            pc = in.arg;
+            break;
+          }
+
+          case Op::BackCommit:
+          {
+            auto& b = backtrack.back();
+            it = b.it;
+            end = b.end;
+            frames.resize(b.frames);
+            match.rollback(b.mark);
+            backtrack.pop_back();
+            pc = in.arg;
+            break;
+          }
+
+          case Op::FailTwice:
+          {
+            backtrack.pop_back();
+            ok = false;
+            break;
+          }
+
+          case Op::Fail:
+          {
+            ok = false;
+            break;
+          }
+
+          case Op::Save:
+          {
+            saved[in.arg] = it;
+            break;
+          }
+
+          case Op::Capture:
+          {
+            match.capture(in.type, {saved[in.arg], it});
+            break;
+          }
+
+          case Op::Enter:
+          {
+            auto node = *saved[in.arg];
+            frames.push_back({it, end});
+            it = node->begin();
+            end = node->end();
+            break;
+          }
+
+          case Op::Leave:
+          {
+            std::tie(it, end) = frames.back();
+            frames.pop_back();
+            break;
+          }
+
+          case Op::Action:
+          {
+            ok = (*actions[in.index])({saved[in.arg], it});
+            break;
+          }
+
+          case Op::Call:
+          {
+            ok = calls[in.index]->match(it, end, match);
+            break;
+          }
+
+          case Op::Match:
+            return true;
+        }
+
+        if (ok)
+          continue;
+
+        if (backtrack.empty())
+        {
+          match.rollback(m);
+          it = begin;
+          return false;
+        }
+
+        auto& b = backtrack.back();
+        pc = b.pc;
+        it = b.it;
+        end = b.end;
+        frames.resize(b.frames);
+        match.rollback(b.mark);
+        backtrack.pop_back();
+      }
+    }
+
     class Pattern;
 
     template<typename T>
@@ -522,6 +1413,28 @@ namespace trieste
         return pattern->match(it, end, match);
       }
 
+      Program compile() const
+      {
+        return {pattern};
+      }
+
+      size_t width() const
+      {
+        return pattern->width();
+      }
+
+      FirstSet first_set() const
+      {
+        FirstSet set;
+
+        // If the pattern can match without consuming a node, it can be
+        // triggered by a node of any type.
+        if (pattern->first_set(set))
+          set.any = true;
+
+        return set;
+      }
+
       Pattern operator()(ActionFn action) const
       {
         return {std::make_shared<Action>(action, pattern)};
@@ -628,7 +1541,7 @@ namespace trieste
   inline detail::Pattern
   In(const Token& type1, const Token& type2, const Ts&... types)
   {
-    std::vector<Token> t = {type1, type2, types...};
+    TokenSet t = {type1, type2, types...};
     return detail::Pattern(std::make_shared<detail::InsideN>(t));
   }
 
@@ -705,7 +1618,7 @@ namespace trieste
 
   inline Node operator<<(Node node, Nodes range)
   {
-    node->push_back({range.begin(), range.end()});
+    node->push_back({range.data(), range.data() + range.size()});
     return node;
   }
 
@@ -742,4 +1655,23 @@ namespace trieste
 
     return nodes;
   }
+
+  inline Node lazy_clone(Node node)
+  {
+    if (node)
+      return node->lazy_clone();
+    else
+      return {};
+  }
+
+  inline Nodes lazy_clone(NodeRange range)
+  {
+    Nodes nodes;
+    nodes.reserve(std::distance(range.first, range.second));
+
+    for (auto it = range.first; it != range.second; ++it)
+      nodes.push_back((*it)->lazy_clone());
+
+    return nodes;
+  }
 }
@@ -0,0 +1,697 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace trieste
+{
+  // A vector that keeps up to `N` elements inline, and only allocates when it
+  // grows past that. Mutable iterators are plain pointers.
+  //
+  // Once on the heap, the elements are kept in a gap buffer. `erase` and
+  // `insert` move the gap to where they are editing and work there, so a run
+  // of edits near the same place costs time proportional to the edits and the
+  // distance between them, rather than to the number of elements after them.
+  // The gap is closed by the non-const `begin`, which moves the elements
+  // before it up to meet the ones after it. The elements after the gap never
+  // move when it is closed, so `end` and the iterators returned by `erase` and
+  // `insert` stay valid across a call to `begin`. Unlike std::vector, `erase`
+  // and `insert` invalidate iterators before the edit as well as after it.
+  //
+  // Reading a const vector doesn't change it: const iterators step over the
+  // gap instead of closing it, so the elements may not be contiguous.
+  template<typename T, size_t N>
+  class SmallVector
+  {
+  private:
+    // Kept at the start of a heap allocation. Physically, the elements are
+    // `front` free slots, then the first `gap_at` elements, then `gap` free
+    // slots, then the rest of the elements, then any free slots at the end.
+    struct Header
+    {
+      uint32_t front;
+      uint32_t gap_at;
+      uint32_t gap;
+    };
+
+    static constexpr size_t header_size =
+      (sizeof(Header) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+    uint32_t size_ = 0;
+    uint32_t capacity_ = N;
+
+    union
+    {
+      T* heap;
+      alignas(T) unsigned char local[N * sizeof(T)];
+    };
+
+    bool is_local() const
+    {
+      return capacity_ == N;
+    }
+
+    T* buffer() const
+    {
+      return is_local() ?
+        reinterpret_cast<T*>(const_cast<unsigned char*>(local)) :
+        heap;
+    }
+
+    Header* header() const
+    {
+      return reinterpret_cast<Header*>(
+        reinterpret_cast<char*>(heap) - header_size);
+    }
+
+    static T* allocate(size_t cap)
+    {
+      auto mem = static_cast<char*>(
+        ::operator new(header_size + (cap * sizeof(T))));
+      new (mem) Header{0, 0, 0};
+      return reinterpret_cast<T*>(mem + header_size);
+    }
+
+    void deallocate()
+    {
+      if (!is_local())
+        ::operator delete(reinterpret_cast<char*>(heap) - header_size);
+    }
+
+    // Where the elements start.
+    T* start() const
+    {
+      return is_local() ? buffer() : heap + header()->front;
+    }
+
+    size_t gap() const
+    {
+      return is_local() ? 0 : header()->gap;
+    }
+
+    // The first free slot in the gap, or null if there is no gap.
+    const T* gap_begin() const
+    {
+      if (is_local() || (header()->gap == 0))
+        return nullptr;
+
+      auto h = header();
+      return heap + h->front + h->gap_at;
+    }
+
+    T* slot(size_t i) const
+    {
+      if (is_local())
+        return buffer() + i;
+
+      auto h = header();
+      return heap + h->front + i + ((i >= h->gap_at) ? h->gap : 0);
+    }
+
+    size_t index(const T* p) const
+    {
+      if (is_local())
+        return size_t(p - buffer());
+
+      auto h = header();
+      auto i = size_t(p - (heap + h->front));
+      return (i > h->gap_at) ? i - h->gap : i;
+    }
+
+    static void relocate(T* from, T* to)
+    {
+      new (to) T(std::move(*from));
+      std::destroy_at(from);
+    }
+
+    // Moves the elements, in order, to a new allocation of `cap` slots, with
+    // no gap and no free slots at the front.
+    void reallocate(size_t cap)
+    {
+      auto p = allocate(cap);
+
+      for (size_t i = 0; i < size_; i++)
+        relocate(slot(i), p + i);
+
+      deallocate();
+      heap = p;
+      capacity_ = static_cast<uint32_t>(cap);
+    }
+
+    void grow(size_t min)
+    {
+      reallocate(std::max(min, size_t(capacity_) * 2));
+    }
+
+    // Moves the gap so that `i` elements precede it.
+    void move_gap(size_t i)
+    {
+      auto h = header();
+      auto p = heap + h->front;
+
+      if (h->gap == 0)
+      {
+        h->gap_at = static_cast<uint32_t>(i);
+        return;
+      }
+
+      for (auto j = h->gap_at; j > i; j--)
+        relocate(p + j - 1, p + j - 1 + h->gap);
+
+      for (auto j = h->gap_at; j < i; j++)
+        relocate(p + j + h->gap, p + j);
+
+      h->gap_at = static_cast<uint32_t>(i);
+    }
+
+    void close()
+    {
+      if (is_local())
+        return;
+
+      auto h = header();
+
+      if (h->gap == 0)
+        return;
+
+      // Move the elements before the gap up to meet the ones after it.
+      auto p = heap + h->front;
+
+      for (auto j = h->gap_at; j > 0; j--)
+        relocate(p + j - 1, p + j - 1 + h->gap);
+
+      h->front += h->gap;
+      h->gap = 0;
+      h->gap_at = 0;
+    }
+
+    // Makes room for `n` elements at the end.
+    void reserve_back(size_t n)
+    {
+      if (is_local())
+      {
+        if (size_ + n > N)
+          grow(size_ + n);
+
+        return;
+      }
+
+      auto h = header();
+
+      if (h->front + size_ + h->gap + n <= capacity_)
+        return;
+
+      if (size_ + n > capacity_ / 2)
+        grow(size_ + n);
+      else
+        reallocate(capacity_);
+    }
+
+  public:
+    // Steps over the gap, if there is one, without closing it.
+    class const_iterator
+    {
+      friend class SmallVector;
+
+    private:
+      const T* p = nullptr;
+      const T* gap_at = nullptr;
+      size_t gap = 0;
+
+      const_iterator(const T* p, const T* gap_at, size_t gap)
+      : p(p), gap_at(gap_at), gap(gap)
+      {}
+
+    public:
+      using iterator_category = std::bidirectional_iterator_tag;
+      using value_type = T;
+      using difference_type = ptrdiff_t;
+      using pointer = const T*;
+      using reference = const T&;
+
+      const_iterator() = default;
+
+      // A mutable iterator is never in the gap.
+      const_iterator(const T* p) : p(p) {}
+
+      operator const T*() const
+      {
+        return p;
+      }
+
+      const T& operator*() const
+      {
+        return *p;
+      }
+
+      const T* operator->() const
+      {
+        return p;
+      }
+
+      const_iterator& operator++()
+      {
+        if (++p == gap_at)
+          p += gap;
+
+        return *this;
+      }
+
+      const_iterator operator++(int)
+      {
+        auto prev = *this;
+        ++*this;
+        return prev;
+      }
+
+      const_iterator& operator--()
+      {
+        if (gap_at && (p == gap_at + gap))
+          p -= gap;
+
+        --p;
+        return *this;
+      }
+
+      const_iterator operator--(int)
+      {
+        auto prev = *this;
+        --*this;
+        return prev;
+      }
+
+      bool operator==(const const_iterator& that) const
+      {
+        return p == that.p;
+      }
+    };
+
+    using value_type = T;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+    using reference = T&;
+    using const_reference = const T&;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using iterator = T*;
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    SmallVector() {}
+
+    SmallVector(std::initializer_list<T> init)
+    {
+      insert(end(), init.begin(), init.end());
+    }
+
+    template<typename It>
+    SmallVector(It first, It last)
+    {
+      insert(end(), first, last);
+    }
+
+    SmallVector(const SmallVector& that)
+    {
+      reserve(that.size_);
+
+      for (size_t i = 0; i < that.size_; i++)
+        push_back(*that.slot(i));
+    }
+
+    SmallVector(SmallVector&& that) noexcept
+    {
+      *this = std::move(that);
+    }
+
+    ~SmallVector()
+    {
+      clear();
+      deallocate();
+    }
+
+    SmallVector& operator=(const SmallVector& that)
+    {
+      if (this != &that)
+      {
+        clear();
+        reserve(that.size_);
+
+        for (size_t i = 0; i < that.size_; i++)
+          push_back(*that.slot(i));
+      }
+
+      return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& that) noexcept
+    {
+      if (this == &that)
+        return *this;
+
+      clear();
+
+      if (!that.is_local())
+      {
+        // Take the heap buffer.
+        deallocate();
+        heap = that.heap;
+        size_ = that.size_;
+        capacity_ = that.capacity_;
+        that.size_ = 0;
+        that.capacity_ = N;
+      }
+      else
+      {
+        for (size_t i = 0; i < that.size_; i++)
+          relocate(that.slot(i), slot(i));
+
+        size_ = that.size_;
+        that.size_ = 0;
+      }
+
+      return *this;
+    }
+
+    // Closes the gap, so that the elements are contiguous.
+    iterator begin()
+    {
+      close();
+      return start();
+    }
+
+    // This doesn't close the gap, so iterators after the gap can be compared
+    // with it.
+    iterator end()
+    {
+      return start() + size_ + gap();
+    }
+
+    const_iterator begin() const
+    {
+      return {slot(0), gap_begin(), gap()};
+    }
+
+    const_iterator end() const
+    {
+      return {start() + size_ + gap(), gap_begin(), gap()};
+    }
+
+    reverse_iterator rbegin()
+    {
+      close();
+      return reverse_iterator(end());
+    }
+
+    reverse_iterator rend()
+    {
+      return reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rbegin() const
+    {
+      return const_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator(begin());
+    }
+
+    T* data()
+    {
+      return begin();
+    }
+
+    bool empty() const
+    {
+      return size_ == 0;
+    }
+
+    size_t size() const
+    {
+      return size_;
+    }
+
+    size_t capacity() const
+    {
+      return capacity_;
+    }
+
+    // Indexing doesn't close the gap.
+    T& operator[](size_t i)
+    {
+      return *slot(i);
+    }
+
+    const T& operator[](size_t i) const
+    {
+      return *slot(i);
+    }
+
+    T& at(size_t i)
+    {
+      if (i >= size_)
+        throw std::out_of_range("SmallVector::at");
+
+      return *slot(i);
+    }
+
+    const T& at(size_t i) const
+    {
+      if (i >= size_)
+        throw std::out_of_range("SmallVector::at");
+
+      return *slot(i);
+    }
+
+    T& front()
+    {
+      return *slot(0);
+    }
+
+    T& back()
+    {
+      return *slot(size_ - 1);
+    }
+
+    const T& front() const
+    {
+      return *slot(0);
+    }
+
+    const T& back() const
+    {
+      return *slot(size_ - 1);
+    }
+
+    // Returns an iterator up to `n` elements before `it`. This moves the gap
+    // to just before that element rather than closing it, so after an edit at
+    // `it` it costs O(n).
+    iterator rewind(const_iterator it, size_t n)
+    {
+      auto i = index(it);
+      i -= std::min(i, n);
+
+      if (is_local())
+        return buffer() + i;
+
+      move_gap(i);
+      return slot(i);
+    }
+
+    void reserve(size_t n)
+    {
+      if (n > capacity_)
+        grow(n);
+    }
+
+    void push_back(const T& value)
+    {
+      // `value` may be one of our own elements.
+      T copy(value);
+      push_back(std::move(copy));
+    }
+
+    void push_back(T&& value)
+    {
+      reserve_back(1);
+      new (end()) T(std::move(value));
+
+      if (!is_local() && (header()->gap == 0))
+        header()->gap_at = size_ + 1;
+
+      size_++;
+    }
+
+    template<typename... Args>
+    T& emplace_back(Args&&... args)
+    {
+      push_back(T(std::forward<Args>(args)...));
+      return back();
+    }
+
+    void pop_back()
+    {
+      std::destroy_at(slot(size_ - 1));
+
+      if (!is_local())
+      {
+        // If nothing follows the gap, the last element is before it, and its
+        // slot becomes part of the gap.
+        auto h = header();
+
+        if (h->gap_at == size_)
+        {
+          h->gap_at--;
+
+          if (h->gap > 0)
+            h->gap++;
+        }
+      }
+
+      size_--;
+    }
+
+    iterator insert(const_iterator pos, T value)
+    {
+      return insert(pos, &value, &value + 1, true);
+    }
+
+    template<typename It>
+    iterator insert(const_iterator pos, It first, It last)
+    {
+      // Copy first, as the source range may be in this vector.
+      std::vector<T> copy(first, last);
+      return insert(pos, copy.data(), copy.data() + copy.size(), true);
+    }
+
+    iterator erase(const_iterator pos)
+    {
+      return erase(pos, pos + 1);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+      auto i = index(first);
+      auto n = size_t(last - first);
+
+      if (n == 0)
+        return slot(i);
+
+      if (is_local())
+      {
+        auto p = buffer();
+        auto e = std::move(p + i + n, p + size_, p + i);
+        std::destroy(e, p + size_);
+        size_ -= static_cast<uint32_t>(n);
+        return p + i;
+      }
+
+      // Open the gap at `first`, and widen it over the erased elements. The
+      // range can't span the gap, as iterators on either side of it aren't
+      // from the same sequence.
+      move_gap(i);
+      auto h = header();
+      auto p = heap + h->front + i + h->gap;
+      std::destroy(p, p + n);
+      h->gap += static_cast<uint32_t>(n);
+      size_ -= static_cast<uint32_t>(n);
+      return p + n;
+    }
+
+    void clear()
+    {
+      for (size_t i = 0; i < size_; i++)
+        std::destroy_at(slot(i));
+
+      size_ = 0;
+
+      if (!is_local())
+        *header() = {0, 0, 0};
+    }
+
+    bool operator==(const SmallVector& that) const
+    {
+      return std::equal(begin(), end(), that.begin(), that.end());
+    }
+
+    bool operator!=(const SmallVector& that) const
+    {
+      return !(*this == that);
+    }
+
+  private:
+    // Moves [first, last), which isn't in this vector, to before `pos`.
+    iterator insert(const_iterator pos, T* first, T* last, bool)
+    {
+      auto i = index(pos);
+      auto n = size_t(last - first);
+
+      if (n == 0)
+        return slot(i);
+
+      if (is_local() && (size_ + n <= N))
+      {
+        // Shift the tail up within the inline buffer.
+        auto p = buffer();
+
+        for (auto j = size_; j > i; j--)
+          relocate(p + j - 1, p + j - 1 + n);
+
+        for (size_t j = 0; j < n; j++)
+          new (p + i + j) T(std::move(first[j]));
+
+        size_ += static_cast<uint32_t>(n);
+        return p + i;
+      }
+
+      if (is_local())
+        grow(size_ + n);
+
+      move_gap(i);
+      auto h = header();
+
+      if (h->gap < n)
+      {
+        // Widen the gap by enough to absorb further inserts here, moving
+        // what follows it into the free slots at the end.
+        auto want = std::max(n, size_t(size_) / 8 + 4);
+
+        if (h->front + size_ + want > capacity_)
+        {
+          reallocate(std::max(size_t(capacity_) * 2, size_ + want));
+          h = header();
+          h->gap_at = static_cast<uint32_t>(i);
+        }
+
+        auto p = heap + h->front;
+        auto d = want - h->gap;
+
+        for (auto j = size_ + h->gap; j > h->gap_at + h->gap; j--)
+          relocate(p + j - 1, p + j - 1 + d);
+
+        h->gap = static_cast<uint32_t>(want);
+      }
+
+      // Fill the end of the gap, so that the new elements are the first ones
+      // after it.
+      auto p = heap + h->front + i + h->gap - n;
+
+      for (size_t j = 0; j < n; j++)
+        new (p + j) T(std::move(first[j]));
+
+      h->gap -= static_cast<uint32_t>(n);
+      size_ += static_cast<uint32_t>(n);
+      return p;
+    }
+  };
+}
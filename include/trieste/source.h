@@ -2,35 +2,218 @@
 // SPDX-License-Identifier: MIT
 #pragma once
 
+#include "intrusive_ptr.h"
+
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#  define TRIESTE_USE_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#endif
+
 namespace trieste
 {
   class SourceDef;
   struct Location;
   class NodeDef;
-  using Source = std::shared_ptr<SourceDef>;
-  using Node = std::shared_ptr<NodeDef>;
+  using Source = intrusive_ptr<SourceDef>;
+  using Node = intrusive_ptr<NodeDef>;
+
+  namespace detail
+  {
+    class SyntheticArena;
+
+    // Every source is registered here, and a `Location` refers to its source
+    // by a 32-bit ID rather than by a counted reference. The registry doesn't
+    // own sources: a source removes itself when its last handle is dropped.
+    // An ID is a slot in the table, in the low bits, and how many times the
+    // slot has been reused, in the high bits. A freed slot is reused with the
+    // next generation, and retired once its generations run out, so an ID is
+    // never handed out twice and a location whose source has been freed fails
+    // to resolve rather than finding another source's text. Lookups don't
+    // take a lock: the table is a fixed array of chunks, and an entry only
+    // changes when its source is added or removed.
+    class SourceRegistry
+    {
+    private:
+      static constexpr size_t slot_bits = 24;
+      static constexpr size_t slot_mask = (size_t(1) << slot_bits) - 1;
+      static constexpr size_t max_generation =
+        (size_t(1) << (32 - slot_bits)) - 1;
+      static constexpr size_t chunk_bits = 16;
+      static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+      static constexpr size_t chunk_count =
+        size_t(1) << (slot_bits - chunk_bits);
+
+      struct Entry
+      {
+        std::atomic<const SourceDef*> source = nullptr;
+
+        // The generation of the slot's next ID. Only used under the lock.
+        uint8_t generation = 0;
+      };
+
+      std::atomic<Entry*> chunks[chunk_count] = {};
+      std::mutex lock;
+      std::vector<uint32_t> free_slots;
+      size_t live = 0;
+
+      // Slot 0 is never used, so that ID 0 can mean "no source".
+      size_t next = 1;
+
+      SourceRegistry() = default;
+
+      Entry& entry(size_t slot) const
+      {
+        auto entries =
+          chunks[slot >> chunk_bits].load(std::memory_order_acquire);
+        return entries[slot & (chunk_size - 1)];
+      }
+
+    public:
+      static SourceRegistry& get()
+      {
+        // Never destroyed, so that locations stay valid during static
+        // destruction.
+        static auto registry = new SourceRegistry();
+        return *registry;
+      }
+
+      uint32_t add(const SourceDef* source)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t slot;
+
+        if (!free_slots.empty())
+        {
+          slot = free_slots.back();
+          free_slots.pop_back();
+        }
+        else if (next <= slot_mask)
+        {
+          slot = next++;
+          auto& chunk = chunks[slot >> chunk_bits];
+
+          if (!chunk.load(std::memory_order_relaxed))
+            chunk.store(new Entry[chunk_size], std::memory_order_release);
+        }
+        else
+        {
+          throw std::runtime_error("too many sources");
+        }
+
+        auto& e = entry(slot);
+        e.source.store(source, std::memory_order_release);
+        live++;
+        return static_cast<uint32_t>(
+          (size_t(e.generation) << slot_bits) | slot);
+      }
+
+      void remove(uint32_t id)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        auto slot = id & slot_mask;
+        auto& e = entry(slot);
+        e.source.store(nullptr, std::memory_order_relaxed);
+        live--;
+
+        if (e.generation < max_generation)
+        {
+          e.generation++;
+          free_slots.push_back(static_cast<uint32_t>(slot));
+        }
+      }
 
+      // The number of sources that are alive.
+      size_t size()
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        return live;
+      }
+
+      const SourceDef* find(uint32_t id) const;
+    };
+  }
+
+  // A source file. Files are memory-mapped where the platform supports it, so
+  // that `view()`, and every `Location` in the source, point directly into the
+  // mapping rather than into a copy of the file. Sources are registered on
+  // creation, so a `Location` only needs the source's ID. A source is freed,
+  // and its mapping released, when the last `Source` handle to it is dropped.
+  // Each node holds a reference to the source of its location, so a source
+  // lives at least as long as the nodes that use it; a bare `Location` is
+  // only valid while something else keeps its source alive. Synthetic
+  // sources, and files that can't be mapped, keep their contents in a string.
   class SourceDef
   {
+    friend class intrusive_ptr<SourceDef>;
+    friend class NodeDef;
+    friend class detail::SyntheticArena;
+
   private:
+    // Sources are shared between threads, unlike nodes, so this is atomic.
+    mutable std::atomic<size_t> refcount_ = 0;
     std::string origin_;
     std::string contents;
-    std::vector<size_t> lines;
+    std::string_view view_;
+    uint32_t id_ = 0;
+    bool arena_ = false;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    // The line index is only needed for diagnostics, so it's built on first
+    // use rather than when the source is loaded.
+    mutable std::once_flag lines_once;
+    mutable std::vector<size_t> lines;
 
   public:
+    SourceDef() = default;
+    SourceDef(const SourceDef&) = delete;
+    SourceDef& operator=(const SourceDef&) = delete;
+
+    ~SourceDef()
+    {
+      if (id_)
+        detail::SourceRegistry::get().remove(id_);
+
+#ifdef TRIESTE_USE_MMAP
+      if (mapping)
+        munmap(mapping, mapping_size);
+#endif
+    }
+
     static Source load(const std::filesystem::path& file)
     {
+#ifdef TRIESTE_USE_MMAP
+      if (auto source = map(file))
+        return source;
+#endif
+
       std::ifstream f(file, std::ios::binary | std::ios::in | std::ios::ate);
 
       if (!f)
@@ -39,7 +222,7 @@ namespace trieste
       auto size = f.tellg();
       f.seekg(0, std::ios::beg);
 
-      auto source = std::make_shared<SourceDef>();
+      auto source = Source(new SourceDef());
       source->origin_ = file.string();
       source->contents.resize(size);
       f.read(&source->contents[0], size);
@@ -47,16 +230,28 @@ namespace trieste
       if (!f)
         return {};
 
-      source->find_lines();
-      return source;
+      source->view_ = source->contents;
+      return registered(source);
     }
 
     static Source synthetic(const std::string& contents)
     {
-      auto source = std::make_shared<SourceDef>();
+      auto source = Source(new SourceDef());
       source->contents = contents;
-      source->find_lines();
-      return source;
+      source->view_ = source->contents;
+      return registered(source);
+    }
+
+    uint32_t id() const
+    {
+      return id_;
+    }
+
+    // True if this source is a chunk of synthetic text shared by many
+    // unrelated locations.
+    bool arena() const
+    {
+      return arena_;
     }
 
     const std::string& origin() const
@@ -66,12 +261,13 @@ namespace trieste
 
     std::string_view view() const
     {
-      return std::string_view(contents);
+      return view_;
     }
 
     std::pair<size_t, size_t> linecol(size_t pos) const
     {
       // Lines and columns are 0-indexed.
+      find_lines();
       auto it = std::lower_bound(lines.begin(), lines.end(), pos);
 
       auto line = it - lines.begin();
@@ -86,11 +282,13 @@ namespace trieste
     std::pair<size_t, size_t> linepos(size_t line) const
     {
       // Lines are 0-indexed.
+      find_lines();
+
       if (line > lines.size())
         return {std::string::npos, 0};
 
       size_t start = 0;
-      auto end = contents.size();
+      auto end = view_.size();
 
       if (line > 0)
         start = lines[line - 1] + 1;
@@ -102,46 +300,182 @@ namespace trieste
     }
 
   private:
-    void find_lines()
+    void intrusive_inc_ref() const
+    {
+      refcount_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void intrusive_dec_ref() const
     {
-      // Find the lines.
-      auto pos = contents.find('\n');
+      if (refcount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+    }
 
-      while (pos != std::string::npos)
+#ifdef TRIESTE_USE_MMAP
+    static Source map(const std::filesystem::path& file)
+    {
+      auto fd = open(file.c_str(), O_RDONLY);
+
+      if (fd < 0)
+        return {};
+
+      // Empty files can't be mapped, and anything other than a regular file
+      // may change size under us, so those are read instead.
+      struct stat st;
+      void* p = MAP_FAILED;
+
+      if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
       {
-        lines.push_back(pos);
-        pos = contents.find('\n', pos + 1);
+        p = mmap(
+          nullptr,
+          static_cast<size_t>(st.st_size),
+          PROT_READ,
+          MAP_PRIVATE,
+          fd,
+          0);
+      }
+
+      close(fd);
+
+      if (p == MAP_FAILED)
+        return {};
+
+      auto source = Source(new SourceDef());
+      source->origin_ = file.string();
+      source->mapping = p;
+      source->mapping_size = static_cast<size_t>(st.st_size);
+      source->view_ = {static_cast<const char*>(p), source->mapping_size};
+      return registered(source);
+    }
+#endif
+
+    static Source registered(Source source)
+    {
+      // Locations use 32-bit offsets.
+      if (source->view_.size() > UINT32_MAX)
+        throw std::runtime_error("source is too large: " + source->origin_);
+
+      source->id_ = detail::SourceRegistry::get().add(source.get());
+      return source;
+    }
+
+    void find_lines() const
+    {
+      std::call_once(lines_once, [this]() { index_lines(); });
+    }
+
+    void index_lines() const
+    {
+      auto data = view_.data();
+      auto size = view_.size();
+      size_t pos = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+      // Compare a block of bytes against '\n' at once, and record the set bits
+      // of the resulting mask.
+      auto record = [&](size_t base, uint32_t mask) {
+        while (mask != 0)
+        {
+          lines.push_back(base + std::countr_zero(mask));
+          mask &= mask - 1;
+        }
+      };
+
+#  if defined(__AVX2__)
+      auto nl32 = _mm256_set1_epi8('\n');
+
+      for (; pos + 32 <= size; pos += 32)
+      {
+        auto block =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        record(
+          pos,
+          static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl32))));
+      }
+#  endif
+
+      auto nl16 = _mm_set1_epi8('\n');
+
+      for (; pos + 16 <= size; pos += 16)
+      {
+        auto block =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        record(
+          pos,
+          static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl16))));
+      }
+#endif
+
+      while (pos < size)
+      {
+        auto p = static_cast<const char*>(
+          std::memchr(data + pos, '\n', size - pos));
+
+        if (!p)
+          break;
+
+        pos = static_cast<size_t>(p - data);
+        lines.push_back(pos++);
       }
     }
   };
 
+  inline const SourceDef* detail::SourceRegistry::find(uint32_t id) const
+  {
+    if (id == 0)
+      return nullptr;
+
+    auto source =
+      entry(id & slot_mask).source.load(std::memory_order_acquire);
+
+    if (!source || (source->id() != id))
+      throw std::runtime_error("location refers to a source that was freed");
+
+    return source;
+  }
+
+  // A range of text in a registered source. This is a small, trivially
+  // copyable value: the source is referred to by its ID, and an ID of 0 means
+  // the location has no source. A location doesn't keep its source alive, and
+  // reading one whose source has been freed throws.
   struct Location
   {
-    Source source;
-    size_t pos;
-    size_t len;
+    uint32_t source_id = 0;
+    uint32_t pos = 0;
+    uint32_t len = 0;
 
     Location() = default;
 
-    Location(Source source, size_t pos, size_t len)
-    : source(source), pos(pos), len(len)
+    Location(const Source& source, size_t pos, size_t len)
+    : source_id(source ? source->id() : 0),
+      pos(static_cast<uint32_t>(pos)),
+      len(static_cast<uint32_t>(len))
     {}
 
-    Location(const std::string& s)
-    : source(SourceDef::synthetic(s)), pos(0), len(s.size())
-    {}
+    // Synthetic text is stored in the calling thread's `SyntheticArena`.
+    Location(const std::string& s);
+
+    const SourceDef* source() const
+    {
+      return detail::SourceRegistry::get().find(source_id);
+    }
 
     std::string_view view() const
     {
-      if (!source)
+      auto src = source();
+
+      if (!src)
         return {};
 
-      return source->view().substr(pos, len);
+      return src->view().substr(pos, len);
     }
 
     std::string origin_linecol() const
     {
       std::stringstream ss;
+      auto source = this->source();
 
       if (source && !source->origin().empty())
       {
@@ -154,6 +488,8 @@ namespace trieste
 
     std::string str() const
     {
+      auto source = this->source();
+
       if (!source)
         return {};
 
@@ -163,7 +499,7 @@ namespace trieste
 
       if (view().find_first_of('\n') != std::string::npos)
       {
-        auto cover = std::min(linelen - col, len);
+        auto cover = std::min(linelen - col, size_t(len));
         std::fill_n(std::ostream_iterator<char>(ss), col, ' ');
         std::fill_n(std::ostream_iterator<char>(ss), cover, '~');
 
@@ -189,6 +525,8 @@ namespace trieste
 
     std::pair<size_t, size_t> linecol() const
     {
+      auto source = this->source();
+
       if (!source)
         return {0, 0};
 
@@ -197,12 +535,15 @@ namespace trieste
 
     Location operator*(const Location& that) const
     {
-      if (source != that.source)
+      // Text in an arena isn't contiguous with its neighbours.
+      if ((source_id != that.source_id) || (source_id && source()->arena()))
         return *this;
 
-      auto lo = std::min(pos, that.pos);
-      auto hi = std::max(pos + len, that.pos + that.len);
-      return {source, lo, hi - lo};
+      Location r;
+      r.source_id = source_id;
+      r.pos = std::min(pos, that.pos);
+      r.len = std::max(pos + len, that.pos + that.len) - r.pos;
+      return r;
     }
 
     Location& operator*=(const Location& that)
@@ -241,4 +582,178 @@ namespace trieste
       return !(*this < that);
     }
   };
+
+  static_assert(std::is_trivially_copyable_v<Location>);
+
+  namespace detail
+  {
+    // Text created while rewriting, such as fresh names, error messages and
+    // folded constants, is appended to large shared sources rather than each
+    // getting a source of its own, and identical text is only stored once.
+    // Each entry is followed by a newline, so that a diagnostic for it shows
+    // just that entry. Each thread appends to its own arena, so a chunk is
+    // only ever written by one thread; another thread may read it once it has
+    // been handed locations in it, such as after joining a parser thread.
+    //
+    // Chunks are only let go of when the outermost `SyntheticScope` on the
+    // thread ends, and only once there are `max_chunks` of them; then all but
+    // the newest are dropped, along with the table entries in them. Chunks
+    // that nodes still use stay alive, so this only frees text that nothing
+    // refers to. A location from the arena that isn't given to a node stays
+    // valid until the outermost scope it was made in ends, and reading it
+    // after that may throw. Without a scope, chunks are kept until the thread
+    // exits.
+    class SyntheticArena
+    {
+      friend class SyntheticScope;
+
+    private:
+      static constexpr size_t chunk_size = 64 * 1024;
+      static constexpr size_t max_chunks = 64;
+
+      // An open-addressing table of the text stored so far. The text of an
+      // entry is found through its location, and an empty slot has no source.
+      struct Slot
+      {
+        uint32_t hash = 0;
+        Location loc;
+      };
+
+      // The last chunk is the one being appended to.
+      std::vector<Source> chunks;
+      size_t used = 0;
+      std::vector<Slot> slots = std::vector<Slot>(1024);
+      size_t count = 0;
+      size_t depth = 0;
+
+      SyntheticArena() = default;
+
+    public:
+      SyntheticArena(const SyntheticArena&) = delete;
+
+      static SyntheticArena& get()
+      {
+        thread_local SyntheticArena arena;
+        return arena;
+      }
+
+      Location intern(std::string_view text)
+      {
+        auto hash = static_cast<uint32_t>(std::hash<std::string_view>()(text));
+        auto mask = slots.size() - 1;
+        auto i = hash & mask;
+
+        for (; slots[i].loc.source_id; i = (i + 1) & mask)
+        {
+          auto& slot = slots[i];
+
+          if ((slot.hash == hash) && (slot.loc.view() == text))
+            return slot.loc;
+        }
+
+        auto size = text.size() + 1;
+
+        if (chunks.empty() || ((chunks.back()->contents.size() - used) < size))
+          grow(std::max(chunk_size, size));
+
+        auto& chunk = chunks.back();
+        auto p = chunk->contents.data() + used;
+        std::memcpy(p, text.data(), text.size());
+        p[text.size()] = '\n';
+
+        // Keep the chunk's line index up to date, since it's never scanned.
+        for (size_t j = 0; j < size; j++)
+        {
+          if (p[j] == '\n')
+            chunk->lines.push_back(used + j);
+        }
+
+        Location loc;
+        loc.source_id = chunk->id();
+        loc.pos = static_cast<uint32_t>(used);
+        loc.len = static_cast<uint32_t>(text.size());
+        used += size;
+
+        slots[i] = {hash, loc};
+
+        if (++count * 2 > slots.size())
+          rehash(slots.size() * 2, 0);
+
+        return loc;
+      }
+
+    private:
+      // Rebuilds the table with `size` slots. If `keep` is set, only the
+      // entries in that source are kept.
+      void rehash(size_t size, uint32_t keep)
+      {
+        std::vector<Slot> old(size);
+        old.swap(slots);
+        auto mask = slots.size() - 1;
+        count = 0;
+
+        for (auto& slot : old)
+        {
+          if (!slot.loc.source_id || (keep && (slot.loc.source_id != keep)))
+            continue;
+
+          auto i = slot.hash & mask;
+
+          while (slots[i].loc.source_id)
+            i = (i + 1) & mask;
+
+          slots[i] = slot;
+          count++;
+        }
+      }
+
+      void release()
+      {
+        if (chunks.size() >= max_chunks)
+        {
+          chunks.erase(chunks.begin(), chunks.end() - 1);
+          rehash(slots.size(), chunks.back()->id());
+        }
+      }
+
+      void grow(size_t size)
+      {
+        auto source = Source(new SourceDef());
+        source->contents.resize(size);
+        source->view_ = source->contents;
+        source->arena_ = true;
+        std::call_once(source->lines_once, []() {});
+        chunks.push_back(SourceDef::registered(source));
+        used = 0;
+      }
+    };
+
+    // Keeps the calling thread's synthetic text while it's open. A pass run
+    // and a parse each open one, so locations made while they run, and not
+    // yet given to a node, aren't freed under them.
+    class SyntheticScope
+    {
+    private:
+      SyntheticArena& arena;
+
+    public:
+      SyntheticScope() : arena(SyntheticArena::get())
+      {
+        arena.depth++;
+      }
+
+      SyntheticScope(const SyntheticScope&) = delete;
+      SyntheticScope& operator=(const SyntheticScope&) = delete;
+
+      ~SyntheticScope()
+      {
+        if (--arena.depth == 0)
+          arena.release();
+      }
+    };
+  }
+
+  inline Location::Location(const std::string& s)
+  : Location(detail::SyntheticArena::get().intern(s))
+  {}
 }
@@ -4,16 +4,18 @@
 
 #include "source.h"
 
+#include <cstdint>
 #include <map>
 
 namespace trieste
 {
   struct TokenDef;
   struct Token;
+  class TokenSet;
 
   namespace detail
   {
-    void register_token(const TokenDef& def);
+    size_t register_token(const TokenDef& def);
   }
 
   struct TokenDef
@@ -22,10 +24,13 @@ namespace trieste
     const char* name;
     flag fl;
 
-    TokenDef(const char* name, flag fl = 0) : name(name), fl(fl)
-    {
-      detail::register_token(*this);
-    }
+    // A dense, sequential ID assigned when the token is registered. This can be
+    // used to index per-token tables.
+    size_t id;
+
+    TokenDef(const char* name, flag fl = 0)
+    : name(name), fl(fl), id(detail::register_token(*this))
+    {}
 
     TokenDef() = delete;
     TokenDef(const TokenDef&) = delete;
@@ -64,22 +69,34 @@ namespace trieste
 
     bool operator<(const Token& that) const
     {
-      return def < that.def;
+      return def->id < that.def->id;
     }
 
     bool operator>(const Token& that) const
     {
-      return def > that.def;
+      return def->id > that.def->id;
     }
 
     bool operator<=(const Token& that) const
     {
-      return def <= that.def;
+      return def->id <= that.def->id;
     }
 
     bool operator>=(const Token& that) const
     {
-      return def >= that.def;
+      return def->id >= that.def->id;
+    }
+
+    size_t id() const
+    {
+      return def->id;
+    }
+
+    // The bit for this token in a 64-bit summary of a set of tokens. This is
+    // shared with every token whose ID is the same modulo 64.
+    uint64_t summary_bit() const
+    {
+      return uint64_t(1) << (def->id % 64);
     }
 
     bool in(const std::initializer_list<Token>& list) const
@@ -92,12 +109,83 @@ namespace trieste
       return std::find(list.begin(), list.end(), *this) != list.end();
     }
 
+    bool in(const TokenSet& set) const;
+
     const char* str() const
     {
       return def->name;
     }
   };
 
+  // A set of tokens, stored as a bitmap indexed by token ID, so that
+  // membership is a single bit test regardless of the size of the set.
+  class TokenSet
+  {
+  private:
+    std::vector<uint64_t> bits;
+
+  public:
+    TokenSet() = default;
+
+    TokenSet(const std::initializer_list<Token>& tokens)
+    {
+      for (auto& t : tokens)
+        insert(t);
+    }
+
+    TokenSet(const std::vector<Token>& tokens)
+    {
+      for (auto& t : tokens)
+        insert(t);
+    }
+
+    void insert(const Token& type)
+    {
+      auto i = type.id();
+
+      if ((i / 64) >= bits.size())
+        bits.resize((i / 64) + 1);
+
+      bits[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    void erase(const Token& type)
+    {
+      auto i = type.id();
+
+      if ((i / 64) < bits.size())
+        bits[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+
+    bool contains(const Token& type) const
+    {
+      auto i = type.id();
+      return ((i / 64) < bits.size()) && ((bits[i / 64] >> (i % 64)) & 1);
+    }
+
+    bool empty() const
+    {
+      return std::all_of(
+        bits.begin(), bits.end(), [](uint64_t b) { return b == 0; });
+    }
+
+    TokenSet& operator|=(const TokenSet& that)
+    {
+      if (that.bits.size() > bits.size())
+        bits.resize(that.bits.size());
+
+      for (size_t i = 0; i < that.bits.size(); i++)
+        bits[i] |= that.bits[i];
+
+      return *this;
+    }
+  };
+
+  inline bool Token::in(const TokenSet& set) const
+  {
+    return set.contains(*this);
+  }
+
   namespace flag
   {
     constexpr TokenDef::flag none = 0;
@@ -146,7 +234,13 @@ namespace trieste
       return global_map;
     }
 
-    inline void register_token(const TokenDef& def)
+    inline std::vector<const TokenDef*>& token_defs()
+    {
+      static std::vector<const TokenDef*> global_defs;
+      return global_defs;
+    }
+
+    inline size_t register_token(const TokenDef& def)
     {
       auto& map = token_map();
       auto it = map.find(def.name);
@@ -156,6 +250,16 @@ namespace trieste
 
       Token t = def;
       map[t.str()] = t;
+
+      // Token IDs are handed out in registration order.
+      auto& defs = token_defs();
+      defs.push_back(&def);
+      return defs.size() - 1;
+    }
+
+    inline size_t token_count()
+    {
+      return token_defs().size();
     }
 
     inline Token find_token(std::string_view str)
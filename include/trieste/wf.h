@@ -117,22 +117,25 @@ namespace trieste
     struct Choice
     {
       std::vector<Token> types;
+      TokenSet set;
+
+      Choice() = default;
+
+      Choice(const std::vector<Token>& types) : types(types), set(types) {}
+
+      Choice& add(const Token& type)
+      {
+        types.push_back(type);
+        set.insert(type);
+        return *this;
+      }
 
       bool check(Node node, std::ostream& out) const
       {
         if (node == Error)
           return true;
 
-        auto ok = false;
-
-        for (auto& type : types)
-        {
-          if (node == type)
-          {
-            ok = true;
-            break;
-          }
-        }
+        auto ok = node->in(set);
 
         if (!ok)
         {
@@ -214,7 +217,7 @@ namespace trieste
         auto has_err = false;
         auto ok = true;
 
-        for (auto& child : *node)
+        for (auto& child : node->peek())
         {
           has_err = has_err || (child == Error);
           ok = choice.check(child, out) && ok;
@@ -286,7 +289,7 @@ namespace trieste
         bool ok = true;
         bool has_error = false;
 
-        for (auto& child : *node)
+        for (auto& child : node->peek())
         {
           // A node that contains an Error node stops checking well-formedness
           // from that point.
@@ -304,7 +307,10 @@ namespace trieste
 
           if ((binding != Invalid) && (field->name == binding))
           {
-            auto defs = node->scope()->look(child->location());
+            // A node shared by a lazy clone may be in a subtree that's no
+            // longer in any scope.
+            auto st = node->scope();
+            auto defs = st ? st->look(child->location()) : Nodes{};
             auto find = std::find(defs.begin(), defs.end(), node);
 
             if (find == defs.end())
@@ -460,45 +466,69 @@ namespace trieste
         if (!node)
           return false;
 
-        if (node == Error)
-          return true;
-
-        auto find = shapes.find(node->type());
+        // The walk reads lazy clones through to their sources, so checking a
+        // tree doesn't give them their own children.
+        Walk walk(node, true);
+        bool ok = true;
 
-        if (find == shapes.end())
+        while (walk.next())
         {
-          // If the shape isn't present, assume it should be empty.
-          if (node->empty())
-            return true;
+          if (!walk.entering())
+            continue;
 
-          out << node->location().origin_linecol()
-              << ": expected 0 children, found " << node->size() << std::endl
-              << node->location().str() << node << std::endl;
-          return false;
-        }
+          auto current = walk.node();
+          auto parent = walk.parent();
 
-        bool ok = std::visit(
-          [&](auto& shape) { return shape.check(node, out); }, find->second);
-
-        for (auto& child : *node)
-        {
-          if (child->parent() != node.get())
+          if (parent && (current->parent() != parent))
           {
-            out << child->location().origin_linecol()
+            out << current->location().origin_linecol()
                 << ": this node appears in the AST multiple times:" << std::endl
-                << child->location().str() << child << std::endl
-                << node->location().origin_linecol() << ": here:" << std::endl
-                << node << std::endl
-                << child->parent()->location().origin_linecol()
-                << ": and here:" << std::endl
-                << child->parent() << std::endl
-                << "Your language implementation needs to explicitly clone "
+                << current->location().str() << current << std::endl
+                << parent->location().origin_linecol() << ": here:" << std::endl
+                << parent << std::endl;
+
+            // The other parent may have been removed from the AST.
+            if (current->parent())
+            {
+              out << current->parent()->location().origin_linecol()
+                  << ": and here:" << std::endl
+                  << current->parent() << std::endl;
+            }
+
+            out << "Your language implementation needs to explicitly clone "
                    "nodes if they're duplicated."
                 << std::endl;
             ok = false;
           }
 
-          ok = check(child, out) && ok;
+          if (current == Error)
+          {
+            walk.skip();
+            continue;
+          }
+
+          auto find = shapes.find(current->type());
+
+          if (find == shapes.end())
+          {
+            // If the shape isn't present, assume it should be empty.
+            if (!current->empty())
+            {
+              out << current->location().origin_linecol()
+                  << ": expected 0 children, found " << current->size()
+                  << std::endl
+                  << current->location().str() << current << std::endl;
+              ok = false;
+            }
+
+            walk.skip();
+            continue;
+          }
+
+          ok = std::visit(
+                 [&](auto& shape) { return shape.check(Node(current), out); },
+                 find->second) &&
+            ok;
         }
 
         return ok;
@@ -591,43 +621,103 @@ namespace trieste
         if (!node)
           return;
 
-        // If the shape isn't present, do nothing, as we assume it should be
-        // empty.
-        auto find = shapes.find(node->type());
-        if (find == shapes.end())
-          return;
-
-        std::visit(
-          [&](auto& shape) { shape.gen(g, depth, node); }, find->second);
+        // Each node's children are generated when it's entered, and then
+        // walked in turn.
+        Walk walk(node);
 
-        for (auto& child : *node)
-          gen_node(g, depth + 1, child);
+        while (walk.next())
+        {
+          if (!walk.entering())
+            continue;
+
+          // If the shape isn't present, do nothing, as we assume it should be
+          // empty.
+          auto current = walk.node();
+          auto find = shapes.find(current->type());
+          if (find == shapes.end())
+            continue;
+
+          std::visit(
+            [&](auto& shape) {
+              shape.gen(g, depth + walk.depth(), Node(current));
+            },
+            find->second);
+        }
       }
 
-      bool build_st(Node node, std::ostream& out) const
+      // A fingerprint of the symbol table bindings of every shape. Trees built
+      // with the same bindings can have their symbol tables rebuilt
+      // incrementally.
+      uint64_t bindings() const
       {
-        if (!node)
-          return false;
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](uint64_t value) {
+          hash = (hash ^ value) * 1099511628211ull;
+        };
 
-        if (node == Error)
-          return true;
+        for (auto& [type, shape] : shapes)
+        {
+          if (auto fields = std::get_if<Fields>(&shape))
+          {
+            if (fields->binding == Invalid)
+              continue;
+
+            mix(type.id());
+            mix(
+              (fields->binding == Include) ?
+                std::numeric_limits<uint64_t>::max() - 1 :
+                fields->index(fields->binding));
+          }
+        }
 
-        node->clear_symbols();
+        return hash ? hash : 1;
+      }
 
-        bool ok = true;
-        auto find = shapes.find(node->type());
+      // The summary bits of every type that binds into a symbol table or has
+      // one. Lazy clones with none of these in them can stay shared while the
+      // symbol tables are built.
+      uint64_t binders() const
+      {
+        uint64_t bits = 0;
 
-        if (find != shapes.end())
+        for (auto& [type, shape] : shapes)
         {
-          ok = std::visit(
-            [&](auto& shape) { return shape.build_st(node, out); },
-            find->second);
+          if (auto fields = std::get_if<Fields>(&shape))
+          {
+            if (fields->binding != Invalid)
+              bits |= type.summary_bit();
+          }
         }
 
-        for (auto& child : *node)
-          ok = build_st(child, out) && ok;
+        for (auto def : detail::token_defs())
+        {
+          Token type = *def;
 
-        return ok;
+          if (type & flag::symtab)
+            bits |= type.summary_bit();
+        }
+
+        return bits;
+      }
+
+      bool build_st(Node node, std::ostream& out) const
+      {
+        if (!node)
+          return false;
+
+        return node->build_symbols(
+          bindings(),
+          [&](Node n) {
+            auto find = shapes.find(n->type());
+
+            if (find == shapes.end())
+              return true;
+
+            return std::visit(
+              [&](auto& shape) { return shape.build_st(n, out); },
+              find->second);
+          },
+          binders());
       }
     };
 
@@ -640,29 +730,32 @@ namespace trieste
 
       inline Choice operator|(const Token& type, const Choice& choice)
       {
-        Choice result{choice.types};
-        result.types.push_back(type);
+        Choice result{choice};
+        result.add(type);
         return result;
       }
 
       inline Choice operator|(const Token& type, Choice&& choice)
       {
-        choice.types.push_back(type);
+        choice.add(type);
         return std::move(choice);
       }
 
       inline Choice operator|(const Choice& choice1, const Choice& choice2)
       {
-        Choice result{choice1.types};
-        result.types.insert(
-          result.types.end(), choice2.types.begin(), choice2.types.end());
+        Choice result{choice1};
+
+        for (auto& type : choice2.types)
+          result.add(type);
+
         return result;
       }
 
       inline Choice operator|(const Choice& choice1, Choice&& choice2)
       {
-        choice2.types.insert(
-          choice2.types.end(), choice1.types.begin(), choice1.types.end());
+        for (auto& type : choice1.types)
+          choice2.add(type);
+
         return std::move(choice2);
       }
 
@@ -683,26 +776,22 @@ namespace trieste
 
       inline Choice operator-(const Choice& choice, const Token& type)
       {
-        Choice result{choice.types};
-        result.types.erase(
-          std::remove(result.types.begin(), result.types.end(), type),
-          result.types.end());
-        return result;
+        std::vector<Token> types{choice.types};
+        types.erase(
+          std::remove(types.begin(), types.end(), type), types.end());
+        return Choice{types};
       }
 
       inline Choice operator-(const Choice& choice1, const Choice& choice2)
       {
-        Choice result{choice1.types};
-        result.types.erase(
+        std::vector<Token> types{choice1.types};
+        types.erase(
           std::remove_if(
-            result.types.begin(),
-            result.types.end(),
-            [&](auto t) {
-              return std::find(choice2.types.begin(), choice2.types.end(), t) !=
-                choice2.types.end();
-            }),
-          result.types.end());
-        return result;
+            types.begin(),
+            types.end(),
+            [&](auto t) { return t.in(choice2.set); }),
+          types.end());
+        return Choice{types};
       }
 
       inline Sequence operator++(const Token& type, int)
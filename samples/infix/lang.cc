@@ -22,24 +22,43 @@ namespace infix
     return Error << (ErrorMsg ^ msg) << (ErrorAst << node);
   }
 
-  bool exists(const NodeRange& n)
+  // Definitions are looked up on every attempt to match in the check_refs and
+  // maths passes, so each thread keeps a cache of them. It refers to nodes in
+  // the tree, so those passes clear it when they finish.
+  LookupCache& lookups()
   {
-    Node node = *n.first;
-    auto defs = node->lookup();
-    return defs.size() > 0;
+    thread_local LookupCache cache;
+    return cache;
   }
 
-  bool can_replace(const NodeRange& n)
+  size_t clear_lookups(Node)
   {
-    Node node = *n.first;
-    auto defs = node->lookup();
-    if (defs.size() == 0)
-    {
+    lookups().clear();
+    return 0;
+  }
+
+  // The first definition of an identifier, or nothing if it's undefined.
+  // This stops at the first definition rather than building a list of them.
+  Node first_def(const Node& node)
+  {
+    Node def;
+    lookups().lookup_each(node, [&](auto& n) {
+      def = n;
       return false;
-    }
+    });
+
+    return def;
+  }
 
-    auto assign = defs.front();
-    return assign->back() == Literal;
+  bool exists(const NodeRange& n)
+  {
+    return bool(first_def(*n.first));
+  }
+
+  bool can_replace(const NodeRange& n)
+  {
+    auto assign = first_def(*n.first);
+    return assign && (assign->back() == Literal);
   }
 
   int get_int(const Node& node)
@@ -125,35 +144,39 @@ namespace infix
   PassDef multiply_divide()
   {
     return {
-      // Group multiply and divide operations together. This rule will
-      // select any triplet of <arg> *|/ <arg> in an expression list and
-      // replace it with a single <expr> node that has the triplet as
-      // its children.
-      In(Expression) *
-          (ExpressionArg[Lhs] * (T(Multiply) / T(Divide))[Op] *
-           ExpressionArg[Rhs]) >>
-        [](Match& _) {
-          return Expression
-            << (_(Op) << (Expression << _(Lhs)) << (Expression << _[Rhs]));
-        },
-      (T(Multiply) / T(Divide))[Op] << End >>
-        [](Match& _) { return err(_(Op), "No arguments"); },
-    };
+      dir::topdown | dir::local,
+      {
+        // Group multiply and divide operations together. This rule will
+        // select any triplet of <arg> *|/ <arg> in an expression list and
+        // replace it with a single <expr> node that has the triplet as
+        // its children.
+        In(Expression) *
+            (ExpressionArg[Lhs] * (T(Multiply) / T(Divide))[Op] *
+             ExpressionArg[Rhs]) >>
+          [](Match& _) {
+            return Expression
+              << (_(Op) << (Expression << _(Lhs)) << (Expression << _[Rhs]));
+          },
+        (T(Multiply) / T(Divide))[Op] << End >>
+          [](Match& _) { return err(_(Op), "No arguments"); },
+      }};
   }
 
   PassDef add_subtract()
   {
     return {
-      In(Expression) *
-          (ExpressionArg[Lhs] * (T(Add) / T(Subtract))[Op] *
-           ExpressionArg[Rhs]) >>
-        [](Match& _) {
-          return Expression
-            << (_(Op) << (Expression << _(Lhs)) << (Expression << _[Rhs]));
-        },
-      (T(Add) / T(Subtract))[Op] << End >>
-        [](Match& _) { return err(_(Op), "No arguments"); },
-    };
+      dir::topdown | dir::local,
+      {
+        In(Expression) *
+            (ExpressionArg[Lhs] * (T(Add) / T(Subtract))[Op] *
+             ExpressionArg[Rhs]) >>
+          [](Match& _) {
+            return Expression
+              << (_(Op) << (Expression << _(Lhs)) << (Expression << _[Rhs]));
+          },
+        (T(Add) / T(Subtract))[Op] << End >>
+          [](Match& _) { return err(_(Op), "No arguments"); },
+      }};
   }
 
   PassDef trim()
@@ -177,12 +200,11 @@ namespace infix
 
   PassDef check_refs()
   {
-    return {
+    PassDef pass = {
       In(Expression) * T(Ident)[Id] >>
         [](Match& _) {
           auto id = _(Id); // the Node object for the identifier
-          auto defs = id->lookup(); // a list of matching symbols
-          if (defs.size() == 0)
+          if (!first_def(id))
           {
             // there are no symbols with this identifier
             return err(id, "undefined");
@@ -191,13 +213,16 @@ namespace infix
           return Ref << id;
         },
     };
+
+    pass.post(clear_lookups);
+    return pass;
   }
 
   inline const auto MathsOp = T(Add) / T(Subtract) / T(Multiply) / T(Divide);
 
   PassDef maths()
   {
-    return {
+    PassDef pass = {
       T(Add) << ((T(Literal) << T(Int)[Lhs]) * (T(Literal) << T(Int)[Rhs])) >>
         [](Match& _) {
           int lhs = get_int(_(Lhs));
@@ -275,11 +300,11 @@ namespace infix
       T(Expression) << (T(Ref) << T(Ident)[Id])(
         [](auto& n) { return can_replace(n); }) >>
         [](Match& _) {
-          auto defs = _(Id)->lookup();
-          auto assign = defs.front();
+          auto assign = first_def(_(Id));
           // the assign node has two children: the ident, and its value
-          // this returns the second
-          return assign->back();
+          // this returns a copy of the second, as it stays in the assign,
+          // which shares its children until either is changed
+          return lazy_clone(assign->back());
         },
 
       T(Expression) << (T(Int) / T(Float))[Rhs] >>
@@ -323,6 +348,9 @@ namespace infix
           (T(Assign)[Assign] << (T(Ident) * (T(Expression) << T(Error)))) >>
         [](Match& _) { return err(_(Assign), "Empty assign expression"); },
     };
+
+    pass.post(clear_lookups);
+    return pass;
   }
 
   PassDef cleanup()
@@ -0,0 +1,58 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that repeated rewrite passes, each replacing a random half of a
+// tree's leaves, don't keep making node slabs. A leaf that survives many
+// passes would pin its slab if freed slots weren't reused.
+#include <trieste/pass.h>
+
+#include <iostream>
+#include <random>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Block = TokenDef("block");
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+}
+
+int main()
+{
+  std::mt19937 rand(0);
+  Node block = Block;
+
+  for (size_t i = 0; i < 20000; i++)
+    block << (Leaf ^ "0");
+
+  Node top = Top << block;
+
+  PassDef pass{
+    dir::topdown | dir::once,
+    {
+      T(Leaf) >> [&](Match&) -> Node {
+        if (rand() % 2)
+          return Leaf ^ "1";
+
+        return NoChange;
+      },
+    }};
+
+  pass.run(top);
+  auto first = detail::NodeArena::count();
+  auto peak = first;
+
+  for (size_t i = 0; i < 100; i++)
+  {
+    pass.run(top);
+    peak = std::max(peak, detail::NodeArena::count());
+  }
+
+  if (peak > first * 2)
+  {
+    std::cout << "Slabs grew from " << first << " to " << peak << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
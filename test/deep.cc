@@ -0,0 +1,154 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that operations over whole trees work on a chain of nodes a million
+// deep, which would overflow the call stack if any of them recursed. This
+// includes destroying the chain.
+#include <trieste/pass.h>
+#include <trieste/wf.h>
+
+#include <iostream>
+#include <sstream>
+
+namespace
+{
+  using namespace trieste;
+  using namespace wf::ops;
+
+  inline const auto Branch = TokenDef("branch");
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+
+  constexpr size_t depth = 1000000;
+
+  // clang-format off
+  inline const auto wf =
+      (Top <<= Branch)
+    | (Branch <<= (Branch | Leaf)++)
+    ;
+  // clang-format on
+
+  Node chain(size_t length, Node bottom)
+  {
+    Node top = Top;
+    Node node = top;
+
+    for (size_t i = 0; i < length; i++)
+    {
+      Node next = Branch;
+      node << next;
+      node = next;
+    }
+
+    node << bottom;
+    return top;
+  }
+
+  Node deepest(Node node)
+  {
+    while (!node->empty())
+      node = node->front();
+
+    return node;
+  }
+
+  bool test_clone()
+  {
+    auto top = chain(depth, Leaf ^ "x");
+    auto copy = top->clone();
+
+    if (!top->equals(copy))
+      return false;
+
+    auto leaf = deepest(copy);
+    leaf->parent()->replace(leaf, Leaf ^ "y");
+    return !top->equals(copy);
+  }
+
+  bool test_location()
+  {
+    auto top = chain(depth, Leaf ^ "x");
+    auto source = SourceDef::synthetic("loc");
+    auto loc = Location(source, 0, 3);
+    top->set_location(loc);
+    auto leaf = deepest(top);
+    return (leaf->parent()->location() == loc) &&
+      (leaf->location().view() == "x");
+  }
+
+  bool test_wf()
+  {
+    auto top = chain(depth, Leaf ^ "x");
+    std::stringstream ss;
+    return wf.build_st(top, ss) && wf.check(top, ss);
+  }
+
+  bool test_lift()
+  {
+    auto top = chain(depth, Leaf ^ "x");
+    PassDef pass = {
+      dir::bottomup | dir::once,
+      {
+        T(Leaf)[Leaf] >> [](Match& _) { return Lift << Top << _(Leaf); },
+      }};
+
+    pass.run(top);
+    return (top->size() == 2) && (top->front() == Leaf) &&
+      (deepest(top->back()) == Branch);
+  }
+
+  bool test_errors()
+  {
+    auto top = chain(depth, Error << (ErrorMsg ^ "deep"));
+    std::stringstream ss;
+    return top->errors(ss) && (ss.str() == "deep\n\n");
+  }
+
+  bool test_str()
+  {
+    // The output grows with the square of the depth, due to indentation, so
+    // this uses a shallower chain.
+    size_t n = 2000;
+    auto top = chain(n, Leaf ^ "x");
+    std::stringstream actual;
+    top->front()->str(actual, 0);
+
+    std::stringstream expect;
+
+    for (size_t i = 0; i < n; i++)
+      expect << indent(i) << "(branch" << std::endl;
+
+    expect << indent(n) << "(leaf 1:x" << std::string(n + 1, ')');
+    return actual.str() == expect.str();
+  }
+}
+
+int main()
+{
+  std::pair<const char*, bool (*)()> tests[] = {
+    {"clone", test_clone},
+    {"location", test_location},
+    {"wf", test_wf},
+    {"lift", test_lift},
+    {"errors", test_errors},
+    {"str", test_str},
+  };
+
+  size_t failed = 0;
+
+  for (auto& [name, test] : tests)
+  {
+    if (!test())
+    {
+      std::cout << name << " failed" << std::endl;
+      failed++;
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,213 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that cached structural hashes match hashes computed from scratch on
+// random trees that are repeatedly edited, that equal trees have equal
+// hashes, that hashes don't change between runs, and that hash-consed leaves
+// are shared.
+#include <trieste/rewrite.h>
+
+#include <iostream>
+#include <random>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Branch = TokenDef("branch");
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+  inline const auto Empty = TokenDef("empty");
+
+  Node leaf(std::mt19937& rand)
+  {
+    const char* names[] = {"a", "b", "c"};
+
+    if (rand() % 4 == 0)
+      return Empty;
+
+    return Leaf ^ std::string(names[rand() % 3]);
+  }
+
+  Node gen(std::mt19937& rand, size_t depth)
+  {
+    if ((depth == 0) || (rand() % 3 == 0))
+      return leaf(rand);
+
+    Node node = Branch;
+    auto count = rand() % 4;
+
+    for (size_t i = 0; i < count; i++)
+      node->push_back(gen(rand, depth - 1));
+
+    return node;
+  }
+
+  // A copy with no cached hashes, unlike clone.
+  Node copy(Node node)
+  {
+    auto result = NodeDef::create(node->type(), node->location());
+
+    for (auto& child : *node)
+      result->push_back(copy(child));
+
+    return result;
+  }
+
+  void nodes(Node node, Nodes& result)
+  {
+    result.push_back(node);
+
+    for (auto& child : *node)
+      nodes(child, result);
+  }
+
+  void edit(Node top, std::mt19937& rand)
+  {
+    Nodes all;
+    nodes(top, all);
+    auto node = all[rand() % all.size()];
+
+    switch (rand() % 3)
+    {
+      case 0:
+      {
+        auto pos = rand() % (node->size() + 1);
+        node->insert(node->begin() + pos, gen(rand, 2));
+        break;
+      }
+
+      case 1:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->erase(node->begin() + pos, node->begin() + pos + 1);
+        }
+        break;
+      }
+
+      default:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->replace(node->at(pos), leaf(rand));
+        }
+        break;
+      }
+    }
+  }
+
+  bool test_cached()
+  {
+    for (uint32_t seed = 0; seed < 200; seed++)
+    {
+      std::mt19937 rand(seed);
+      Node top = Top << gen(rand, 5);
+
+      for (size_t step = 0; step < 20; step++)
+      {
+        // Hash some subtrees, so that edits have cached hashes to invalidate.
+        Nodes all;
+        nodes(top, all);
+        all[rand() % all.size()]->hash();
+
+        for (auto edits = rand() % 3; edits > 0; edits--)
+          edit(top, rand);
+
+        if (top->hash() != copy(top)->hash())
+        {
+          std::cout << "Seed " << seed << ", step " << step
+                    << ": stale hash" << std::endl;
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+
+  bool test_equal()
+  {
+    std::mt19937 rand(0);
+
+    for (size_t i = 0; i < 20000; i++)
+    {
+      auto a = gen(rand, 2);
+      auto b = gen(rand, 2);
+
+      if (a->equals(b) != (a->hash() == b->hash()))
+      {
+        std::cout << "Pair " << i << ": hashes disagree with equals"
+                  << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool test_stable()
+  {
+    // Hashes depend only on token names, text and shape.
+    Node tree = Branch << (Leaf ^ "a") << (Branch << Empty << (Leaf ^ "bc"));
+
+    if (tree->hash() != 0x4d8c91860cc6ull)
+    {
+      std::cout << "Hash changed: " << std::hex << tree->hash() << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+
+  bool test_hashcons()
+  {
+    HashCons leaves;
+    auto a1 = leaves.intern(Leaf ^ "a");
+    auto a2 = leaves.intern(Leaf ^ "a");
+    auto b = leaves.intern(Leaf ^ "b");
+    auto e1 = leaves.intern(Empty);
+    auto e2 = leaves.intern(Empty);
+    auto a3 = leaves.make(Leaf, "a");
+    auto c = leaves.make(Leaf, "c");
+
+    // A made leaf is a new node, but shares the canonical leaf's text.
+    auto& l1 = a1->location();
+    auto& l3 = a3->location();
+    auto shared = (l1.source_id == l3.source_id) && (l1.pos == l3.pos);
+
+    return (a1 == a2) && (a1 != b) && (e1 == e2) && (a3 != a1) &&
+      a3->equals(a1) && shared && (c->location().view() == "c") &&
+      (leaves.size() == 4);
+  }
+}
+
+int main()
+{
+  std::pair<const char*, bool (*)()> tests[] = {
+    {"cached", test_cached},
+    {"equal", test_equal},
+    {"stable", test_stable},
+    {"hashcons", test_hashcons},
+  };
+
+  size_t failed = 0;
+
+  for (auto& [name, test] : tests)
+  {
+    if (!test())
+    {
+      std::cout << name << " failed" << std::endl;
+      failed++;
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,273 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that lazy clones behave like eager clones when either the original
+// or the clone is edited, that reading a lazy clone doesn't make its
+// children, and that the children that are made have the right parents. Also
+// checks that building symbol tables and checking well-formedness only make
+// the children of clones that have bindings in them.
+#include <trieste/rewrite.h>
+#include <trieste/wf.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  using namespace trieste;
+  using namespace wf::ops;
+
+  inline const auto Branch = TokenDef("branch");
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+  inline const auto Block = TokenDef("block", flag::symtab);
+  inline const auto Let = TokenDef("let", flag::lookup);
+  inline const auto Ident = TokenDef("ident", flag::print);
+
+  // clang-format off
+  inline const auto wf =
+      (Top <<= Block)
+    | (Block <<= (Let | Branch)++)
+    | (Branch <<= (Branch | Block | Leaf)++)
+    | (Let <<= Ident * Branch)[Ident]
+    ;
+  // clang-format on
+
+  // Leaves share a source, so that extending one leaf's location by
+  // another's changes its text.
+  const auto source = SourceDef::synthetic("abcdefgh");
+
+  Node leaf(size_t pos)
+  {
+    return Leaf ^ Location(source, pos, 1);
+  }
+
+  Node gen(std::mt19937& rand, size_t depth)
+  {
+    if ((depth == 0) || (rand() % 4 == 0))
+      return leaf(rand() % 8);
+
+    Node node = Branch;
+    auto count = rand() % 4;
+
+    for (size_t i = 0; i < count; i++)
+      node << gen(rand, depth - 1);
+
+    return node;
+  }
+
+  // Follows a random path down from the top, which only makes the lazy
+  // children on that path.
+  Node pick(Node node, std::mt19937& rand)
+  {
+    while (!node->empty() && (rand() % 3 != 0))
+      node = node->at(rand() % node->size());
+
+    return node;
+  }
+
+  // Makes the same edit to trees that are equal, given the same random state.
+  // Subtrees that are copied are lazy clones if `lazy` is set.
+  void edit(Node top, std::mt19937& rand, bool lazy)
+  {
+    auto node = pick(top, rand);
+
+    switch (rand() % 5)
+    {
+      case 0:
+      {
+        auto pos = rand() % (node->size() + 1);
+        node->insert(node->begin() + pos, gen(rand, 2));
+        break;
+      }
+
+      case 1:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->erase(node->begin() + pos, node->begin() + pos + 1);
+        }
+        break;
+      }
+
+      case 2:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->replace(node->at(pos), leaf(rand() % 8));
+        }
+        break;
+      }
+
+      case 3:
+      {
+        auto from = pick(top, rand);
+
+        if (node != Leaf)
+          node << (lazy ? lazy_clone(from) : clone(from));
+        break;
+      }
+
+      default:
+      {
+        node->extend(pick(top, rand)->location());
+        break;
+      }
+    }
+  }
+
+  std::string str(Node node)
+  {
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+  }
+
+  bool same(Node actual, Node expect)
+  {
+    return actual->equals(expect) && (str(actual) == str(expect)) &&
+      (actual->hash() == expect->clone()->hash());
+  }
+
+  bool parents(Node node)
+  {
+    for (auto& child : *node)
+    {
+      if ((child->parent() != node.get()) || !parents(child))
+        return false;
+    }
+
+    return true;
+  }
+
+  bool test_edit()
+  {
+    for (uint32_t seed = 0; seed < 500; seed++)
+    {
+      std::mt19937 rand(seed);
+      Node top = Top << gen(rand, 6);
+      auto top_expect = top->clone();
+      auto copy = top->lazy_clone();
+      auto copy_expect = top->clone();
+
+      for (size_t step = 0; step < 20; step++)
+      {
+        // Edit the original, the clone, or a lazy clone of the clone.
+        auto choice = rand() % 3;
+
+        if (choice == 2)
+        {
+          copy = copy->lazy_clone();
+          continue;
+        }
+
+        auto [actual, expect] = (choice == 0) ?
+          std::pair{top, top_expect} :
+          std::pair{copy, copy_expect};
+
+        auto r = rand;
+        edit(actual, r, true);
+        edit(expect, rand, false);
+
+        if (!same(top, top_expect) || !same(copy, copy_expect))
+        {
+          std::cout << "Seed " << seed << ", step " << step
+                    << ": trees differ" << std::endl;
+          return false;
+        }
+      }
+
+      if (!parents(top) || !parents(copy))
+      {
+        std::cout << "Seed " << seed << ": wrong parent" << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool test_read()
+  {
+    std::mt19937 rand(0);
+    Node top = Top << gen(rand, 8);
+    auto copy = top->lazy_clone();
+    auto expect = str(top);
+
+    // Reading the clone doesn't make its children.
+    auto ok = (str(copy) == expect) && top->equals(copy) &&
+      (copy->hash() == top->hash()) && copy->clone()->equals(top) &&
+      copy->lazy();
+
+    // Editing the clone makes only the children on the path to the edit.
+    auto node = copy->front();
+    ok = ok && !copy->lazy() && (node->lazy() || node->empty());
+    copy->push_back(leaf(0));
+    return ok && (str(top) == expect) && !top->equals(copy);
+  }
+
+  // Copies a definition's value into a list of uses, as inlining would, then
+  // builds and checks the tree. A value with no bindings in it stays shared,
+  // and one with bindings gets its own children so they can be bound.
+  bool test_wf()
+  {
+    std::mt19937 rand(0);
+    Node value = Branch << gen(rand, 6) << gen(rand, 6);
+    Node inner = Branch << (Block << (Let << (Ident ^ "x") << gen(rand, 3)));
+    Node block = Block << (Let << (Ident ^ "v") << value);
+    Nodes copies;
+
+    for (size_t i = 0; i < 10; i++)
+    {
+      copies.push_back(value->lazy_clone());
+      copies.push_back(inner->lazy_clone());
+      block << copies[copies.size() - 2] << copies.back();
+    }
+
+    Node top = Top << block;
+    std::stringstream ss;
+    auto ok = wf.build_st(top, ss) && wf.check(top, ss);
+
+    if (!ok)
+      std::cout << ss.str();
+
+    for (size_t i = 0; i < copies.size(); i += 2)
+      ok = ok && copies[i]->lazy() && !copies[i + 1]->lazy();
+
+    // Adding another clone and building again leaves the clones shared.
+    block->push_back(value->lazy_clone());
+    ok = ok && wf.build_st(top, ss) && wf.check(top, ss) &&
+      block->back()->lazy() && copies.front()->lazy();
+    return ok;
+  }
+}
+
+int main()
+{
+  std::pair<const char*, bool (*)()> tests[] = {
+    {"edit", test_edit},
+    {"read", test_read},
+    {"wf", test_wf},
+  };
+
+  size_t failed = 0;
+
+  for (auto& [name, test] : tests)
+  {
+    if (!test())
+    {
+      std::cout << name << " failed" << std::endl;
+      failed++;
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
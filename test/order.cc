@@ -0,0 +1,148 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that precedes and common_parent agree with a walk of the tree in
+// document order, on random trees that are repeatedly edited in ways that
+// shift children, so that cached child positions go stale.
+#include <trieste/ast.h>
+
+#include <iostream>
+#include <random>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Branch = TokenDef("branch");
+  inline const auto Leaf = TokenDef("leaf");
+
+  Node gen(std::mt19937& rand, size_t depth)
+  {
+    if ((depth == 0) || (rand() % 3 == 0))
+      return Leaf;
+
+    Node node = Branch;
+    auto count = rand() % 5;
+
+    for (size_t i = 0; i < count; i++)
+      node->push_back(gen(rand, depth - 1));
+
+    return node;
+  }
+
+  // Pre-order, with the number of descendants of each node.
+  void walk(Node node, Nodes& order, std::vector<size_t>& size)
+  {
+    auto i = order.size();
+    order.push_back(node);
+    size.push_back(0);
+
+    for (auto& child : *node)
+      walk(child, order, size);
+
+    size[i] = order.size() - i - 1;
+  }
+
+  void edit(Node top, std::mt19937& rand)
+  {
+    Nodes order;
+    std::vector<size_t> size;
+    walk(top, order, size);
+    auto node = order[rand() % order.size()];
+
+    switch (rand() % 4)
+    {
+      case 0:
+      {
+        auto pos = rand() % (node->size() + 1);
+        node->insert(node->begin() + pos, gen(rand, 2));
+        break;
+      }
+
+      case 1:
+      {
+        node->push_front(gen(rand, 2));
+        break;
+      }
+
+      case 2:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->erase(node->begin() + pos, node->begin() + pos + 1);
+        }
+        break;
+      }
+
+      default:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->replace(node->at(pos), gen(rand, 2));
+        }
+        break;
+      }
+    }
+  }
+}
+
+int main()
+{
+  size_t failed = 0;
+
+  for (uint32_t seed = 0; (seed < 200) && (failed == 0); seed++)
+  {
+    std::mt19937 rand(seed);
+    Node top = Top;
+    top->push_back(gen(rand, 5));
+    top->push_back(gen(rand, 5));
+
+    for (size_t step = 0; (step < 50) && (failed == 0); step++)
+    {
+      for (auto edits = rand() % 3; edits > 0; edits--)
+        edit(top, rand);
+
+      Nodes order;
+      std::vector<size_t> size;
+      walk(top, order, size);
+
+      for (size_t k = 0; k < 20; k++)
+      {
+        auto i = rand() % order.size();
+        auto j = rand() % order.size();
+        auto& a = order[i];
+        auto& b = order[j];
+
+        // A precedes B iff it comes first and doesn't contain B.
+        auto expect = (i < j) && (j > i + size[i]);
+
+        // The common parent is the last node before both that contains both.
+        Node parent;
+
+        for (size_t p = 0; p <= std::min(i, j); p++)
+        {
+          if ((i <= p + size[p]) && (j <= p + size[p]))
+            parent = order[p];
+        }
+
+        if ((a->precedes(b) != expect) || (a->common_parent(b) != parent))
+        {
+          std::cout << "Seed " << seed << ", step " << step << ": nodes " << i
+                    << " and " << j << " are misordered" << std::endl;
+          failed++;
+          break;
+        }
+      }
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,140 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that trees can be freed by the reclaimer while new trees are being
+// built, and which trees share nodes with anything else.
+#include <trieste/reclaim.h>
+#include <trieste/rewrite.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Block = TokenDef("block", flag::symtab);
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+
+  Node gen(std::mt19937& rand, size_t depth)
+  {
+    if ((depth == 0) || (rand() % 4 == 0))
+      return Leaf ^ std::to_string(rand() % 100);
+
+    Node node = Block;
+    auto count = rand() % 6;
+
+    for (size_t i = 0; i < count; i++)
+      node << gen(rand, depth - 1);
+
+    return node;
+  }
+
+  std::string str(Node node)
+  {
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+  }
+}
+
+int main()
+{
+  size_t failed = 0;
+  std::mt19937 rand(0);
+  Node kept;
+  std::string expect;
+
+  for (size_t i = 0; i < 200; i++)
+  {
+    Node top = Top << gen(rand, 8);
+    auto copy = top->clone();
+
+    if (!top->equals(copy))
+    {
+      std::cout << "Tree " << i << " wasn't copied" << std::endl;
+      failed++;
+    }
+
+    if (i == 100)
+    {
+      kept = copy;
+      expect = str(kept);
+    }
+
+    reclaim(std::move(top));
+    reclaim(std::move(copy));
+
+    if (top || copy)
+    {
+      std::cout << "Tree " << i << " wasn't retired" << std::endl;
+      failed++;
+    }
+  }
+
+  Reclaimer::get().wait();
+
+  if (str(kept) != expect)
+  {
+    std::cout << "A tree that was still in use was freed" << std::endl;
+    failed++;
+  }
+
+  // Retiring a tree that shares nodes is up to the caller to avoid, and is
+  // only checked in debug builds. A tree whose nodes are only referred to by
+  // its own symbol tables is exclusive, and one that shares a node with
+  // anything else, or has a lazy clone in it, isn't.
+  {
+    Node def = Leaf ^ "def";
+    Node top = Top << (Block << def);
+    def->bind(def->location());
+    def = nullptr;
+
+    if (!top->exclusive())
+    {
+      std::cout << "A tree bound into itself wasn't exclusive" << std::endl;
+      failed++;
+    }
+
+    reclaim(std::move(top));
+
+    Node held = Leaf ^ "held";
+    top = Top << (Block << held);
+
+    if (top->exclusive())
+    {
+      std::cout << "A tree with a shared node was exclusive" << std::endl;
+      failed++;
+    }
+
+    Node source = Top << (Block << (Leaf ^ "source"));
+    Node view = source->lazy_clone();
+
+    if (source->exclusive() || view->exclusive())
+    {
+      std::cout << "A lazy clone was exclusive" << std::endl;
+      failed++;
+    }
+
+    // A root that still has another handle is dropped as usual.
+    Node other = top;
+    reclaim(std::move(top));
+
+    if (!other->unique())
+    {
+      std::cout << "A tree with a shared root was retired" << std::endl;
+      failed++;
+    }
+
+    Reclaimer::get().wait();
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that a pass in local mode, which resumes matching just before each
+// rewrite, makes the same rewrites in the same order as the same pass
+// restarting from the first child. The rules overlap and depend on the order
+// they are applied in, so any difference in order shows up in the result.
+#include <trieste/pass.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Block = TokenDef("block");
+  inline const auto A = TokenDef("a");
+  inline const auto B = TokenDef("b");
+  inline const auto C = TokenDef("c");
+
+  // Every rule lowers the total weight of the nodes it replaces, counting
+  // 2 for A, 3 for B and 5 for C, so the pass terminates.
+  PassDef pass(dir::flag direction)
+  {
+    return {
+      direction,
+      {
+        T(A) * T(B) * T(A) >> [](Match&) -> Node { return B; },
+
+        T(C) * T(C) >> [](Match&) -> Node { return A; },
+
+        Start * T(B) * --T(C) >> [](Match&) -> Node { return A; },
+
+        T(B) * T(C) * End >> [](Match&) -> Node { return C; },
+
+        (T(A) / T(B)) * !T(C) * T(A) >> [](Match&) -> Node { return C; },
+
+        T(C) * ++T(B) >> [](Match&) -> Node { return A; },
+
+        T(A) * ~T(B) * T(C) >> [](Match&) -> Node { return B; },
+
+        In(Block) * T(B) * T(B) >> [](Match&) -> Node { return A; },
+      }};
+  }
+
+  Node gen(std::mt19937& rand)
+  {
+    Token types[] = {A, B, C};
+    Node block = Block;
+    auto count = rand() % 300;
+
+    for (size_t i = 0; i < count; i++)
+      block << types[rand() % 3];
+
+    return Top << block;
+  }
+
+  std::string run(Node top, dir::flag direction)
+  {
+    auto p = pass(direction);
+    auto [result, count, changes] = p.run(top);
+    std::stringstream ss;
+    ss << changes << std::endl << result;
+    return ss.str();
+  }
+}
+
+int main()
+{
+  size_t failed = 0;
+
+  for (uint32_t seed = 0; seed < 1000; seed++)
+  {
+    for (auto direction : {dir::topdown, dir::bottomup})
+    {
+      std::mt19937 rand(seed);
+      auto top = gen(rand);
+      auto expect = run(top->clone(), direction);
+      auto actual = run(top, direction | dir::local);
+
+      if (actual != expect)
+      {
+        std::cout << "Seed " << seed << ": expected" << std::endl
+                  << expect << std::endl
+                  << "got" << std::endl
+                  << actual << std::endl;
+        failed++;
+      }
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,74 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that a SmallVector matches a std::vector through random inserts and
+// erases, and that iterating over it as const, forwards or backwards, reads
+// the elements in order without moving them.
+#include <trieste/small_vector.h>
+
+#include <iostream>
+#include <random>
+
+namespace
+{
+  using namespace trieste;
+
+  bool same(const SmallVector<int, 2>& v, const std::vector<int>& expect)
+  {
+    auto first = v.empty() ? nullptr : &v[0];
+
+    if (!std::equal(v.begin(), v.end(), expect.begin(), expect.end()))
+      return false;
+
+    if (!std::equal(v.rbegin(), v.rend(), expect.rbegin(), expect.rend()))
+      return false;
+
+    return v.empty() || (&v[0] == first);
+  }
+}
+
+int main()
+{
+  std::mt19937 rand(0);
+  size_t failed = 0;
+
+  for (size_t seed = 0; seed < 100; seed++)
+  {
+    SmallVector<int, 2> v;
+    std::vector<int> expect;
+
+    for (int i = 0; i < 500; i++)
+    {
+      auto pos = expect.empty() ? 0 : rand() % (expect.size() + 1);
+
+      if ((rand() % 3 == 0) && (pos < expect.size()))
+      {
+        auto n = std::min<size_t>(rand() % 4 + 1, expect.size() - pos);
+        auto it = v.begin() + pos;
+        v.erase(it, it + n);
+        expect.erase(expect.begin() + pos, expect.begin() + pos + n);
+      }
+      else
+      {
+        v.insert(v.begin() + pos, i);
+        expect.insert(expect.begin() + pos, i);
+      }
+
+      if (!same(v, expect))
+      {
+        std::cout << "Seed " << seed << ", edit " << i << " differs"
+                  << std::endl;
+        failed++;
+        break;
+      }
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,173 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that loading and dropping a file many times doesn't leave its
+// mapping or its registry entry behind, that source IDs aren't handed out
+// twice, that a location whose source was freed fails rather than finding
+// another source's text, that synthetic text isn't freed while a scope that
+// made it is open, and that a node keeps its source alive after the last
+// handle to it is dropped.
+#include <trieste/rewrite.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Leaf = TokenDef("leaf", flag::print);
+
+  const auto text = std::string("hello\nworld\n");
+
+  std::filesystem::path path()
+  {
+    return std::filesystem::temp_directory_path() / "trieste_source_test.txt";
+  }
+
+  size_t live()
+  {
+    return detail::SourceRegistry::get().size();
+  }
+
+  // The number of mappings of the test file, where the platform lists them.
+  size_t mappings()
+  {
+    size_t count = 0;
+#ifdef __linux__
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+
+    while (std::getline(maps, line))
+    {
+      if (line.find(path().string()) != std::string::npos)
+        count++;
+    }
+#endif
+    return count;
+  }
+
+  bool test_load()
+  {
+    auto before = live();
+    std::set<uint32_t> ids;
+
+    for (size_t i = 0; i < 10000; i++)
+    {
+      auto source = SourceDef::load(path());
+
+      if (
+        !source || (source->view() != text) ||
+        !ids.insert(source->id()).second)
+        return false;
+    }
+
+    return (live() == before) && (mappings() == 0);
+  }
+
+  bool test_stale()
+  {
+    auto source = SourceDef::synthetic("old text");
+    auto loc = Location(source, 0, 3);
+    source = nullptr;
+
+    // Another source takes the freed source's place in the registry.
+    auto other = SourceDef::synthetic("new text");
+
+    try
+    {
+      loc.view();
+      return false;
+    }
+    catch (const std::runtime_error&)
+    {
+      return Location(other, 0, 3).view() == "new";
+    }
+  }
+
+  // Fills more arena chunks than the arena keeps, holding on to a bare
+  // location from the first chunk and a node from the second.
+  bool test_synthetic()
+  {
+    auto before = live();
+    Node node;
+
+    {
+      detail::SyntheticScope scope;
+      auto first = Location(std::string(1000, 'a'));
+
+      for (size_t i = 0; i < 5000; i++)
+      {
+        auto loc = Location(std::to_string(i) + std::string(1000, 'b'));
+
+        if (i == 100)
+          node = Leaf ^ loc;
+      }
+
+      if (first.view() != std::string(1000, 'a'))
+        return false;
+    }
+
+    // The chunks nothing refers to are freed once the scope ends.
+    return (live() < before + 10) &&
+      (node->location().view() == "100" + std::string(1000, 'b'));
+  }
+
+  bool test_node()
+  {
+    auto before = live();
+    auto source = SourceDef::load(path());
+    Node node = Leaf ^ Location(source, 6, 5);
+    source = nullptr;
+
+    if ((live() != before + 1) || (node->location().view() != "world"))
+      return false;
+
+#ifdef __linux__
+    // The mapping must be visible for its absence to mean anything.
+    if (mappings() != 1)
+      return false;
+#endif
+
+    node = nullptr;
+    return (live() == before) && (mappings() == 0);
+  }
+}
+
+int main()
+{
+  {
+    std::ofstream f(path(), std::ios::binary);
+    f << text;
+  }
+
+  std::pair<const char*, bool (*)()> tests[] = {
+    {"load", test_load},
+    {"stale", test_stale},
+    {"synthetic", test_synthetic},
+    {"node", test_node},
+  };
+
+  size_t failed = 0;
+
+  for (auto& [name, test] : tests)
+  {
+    if (!test())
+    {
+      std::cout << name << " failed" << std::endl;
+      failed++;
+    }
+  }
+
+  std::filesystem::remove(path());
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,251 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that incrementally rebuilt symbol tables match a full rebuild, on
+// random trees of nested scopes that are repeatedly edited by inserting,
+// removing, renaming and moving definitions. Also checks that a LookupCache
+// kept across the edits agrees with uncached lookups, including from scopes
+// where definitions have to come before their uses.
+#include <trieste/rewrite.h>
+#include <trieste/wf.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+  using namespace trieste;
+  using namespace wf::ops;
+
+  inline const auto Block = TokenDef("block", flag::symtab);
+  inline const auto Ordered =
+    TokenDef("ordered", flag::symtab | flag::defbeforeuse);
+  inline const auto Func =
+    TokenDef("func", flag::symtab | flag::lookup | flag::shadowing);
+  inline const auto Let = TokenDef("let", flag::lookup);
+  inline const auto Use = TokenDef("use");
+  inline const auto Body = TokenDef("body");
+  inline const auto Ident = TokenDef("ident", flag::print);
+
+  // clang-format off
+  inline const auto wf =
+      (Top <<= Block)
+    | (Block <<= (Block | Ordered | Func | Let | Use)++)
+    | (Ordered <<= (Block | Ordered | Func | Let | Use)++)
+    | (Body <<= (Block | Ordered | Func | Let | Use)++)
+    | (Func <<= Ident * Body)[Ident]
+    | (Let <<= Ident)[Ident]
+    | (Use <<= Ident)
+    ;
+  // clang-format on
+
+  Node ident(std::mt19937& rand)
+  {
+    const char* names[] = {"a", "b", "c", "d", "e"};
+    return Ident ^ std::string(names[rand() % 5]);
+  }
+
+  Node gen(std::mt19937& rand, size_t depth)
+  {
+    switch (rand() % ((depth > 0) ? 5 : 3))
+    {
+      case 0:
+        return Let << ident(rand);
+
+      case 1:
+      case 2:
+        return Use << ident(rand);
+
+      default:
+      {
+        Token types[] = {Body, Block, Ordered};
+        Node body = types[rand() % 3];
+        auto count = rand() % 4;
+
+        for (size_t i = 0; i < count; i++)
+          body << gen(rand, depth - 1);
+
+        if (body != Body)
+          return body;
+
+        return Func << ident(rand) << body;
+      }
+    }
+  }
+
+  // The nodes whose children are a list of definitions and uses.
+  void containers(Node node, Nodes& result)
+  {
+    if (node->type().in({Block, Ordered, Body}))
+      result.push_back(node);
+
+    for (auto& child : *node)
+      containers(child, result);
+  }
+
+  void edit(Node top, std::mt19937& rand)
+  {
+    Nodes nodes;
+    containers(top, nodes);
+    auto node = nodes[rand() % nodes.size()];
+
+    switch (rand() % 4)
+    {
+      case 0:
+      {
+        auto pos = rand() % (node->size() + 1);
+        node->insert(node->begin() + pos, gen(rand, 3));
+        break;
+      }
+
+      case 1:
+      {
+        if (!node->empty())
+        {
+          auto pos = rand() % node->size();
+          node->erase(node->begin() + pos, node->begin() + pos + 1);
+        }
+        break;
+      }
+
+      case 2:
+      {
+        // Rename a definition or a use.
+        for (auto& child : *node)
+        {
+          if (child->type().in({Func, Let, Use}) && (rand() % 2))
+          {
+            child->replace(child->front(), ident(rand));
+            break;
+          }
+        }
+        break;
+      }
+
+      default:
+      {
+        // Move a child to another container that isn't inside it.
+        auto to = nodes[rand() % nodes.size()];
+
+        if (node->empty())
+          break;
+
+        auto pos = rand() % node->size();
+        auto child = node->at(pos);
+
+        for (auto p = to.get(); p; p = p->parent())
+        {
+          if (p == child.get())
+            return;
+        }
+
+        node->erase(node->begin() + pos, node->begin() + pos + 1);
+        to->push_back(child);
+        break;
+      }
+    }
+  }
+
+  void uses(Node node, Nodes& result)
+  {
+    if (node == Use)
+      result.push_back(node->front());
+
+    for (auto& child : *node)
+      uses(child, result);
+  }
+
+  bool check_cache(Node top, LookupCache& cache)
+  {
+    Nodes refs;
+    uses(top, refs);
+
+    for (auto& ref : refs)
+    {
+      auto expect = ref->lookup();
+
+      if (cache.lookup(ref) != expect)
+        return false;
+
+      // Stopping after the first node visits only that node.
+      Nodes first;
+      cache.lookup_each(ref, [&](const Node& n) {
+        first.push_back(n);
+        return false;
+      });
+
+      if (first.size() != std::min<size_t>(expect.size(), 1))
+        return false;
+
+      if (!first.empty() && (first.front() != expect.front()))
+        return false;
+    }
+
+    return true;
+  }
+
+  std::string build(Node top)
+  {
+    std::stringstream ss;
+    auto ok = wf.build_st(top, ss);
+    ss << ok << std::endl << top;
+    return ss.str();
+  }
+}
+
+int main()
+{
+  size_t failed = 0;
+
+  for (uint32_t seed = 0; seed < 500; seed++)
+  {
+    std::mt19937 rand(seed);
+    Node block = Block;
+
+    for (size_t i = 0; i < 6; i++)
+      block << gen(rand, 4);
+
+    Node top = Top << block;
+    LookupCache cache;
+
+    for (size_t step = 0; step < 20; step++)
+    {
+      auto edits = rand() % 4;
+
+      for (size_t i = 0; i < edits; i++)
+        edit(top, rand);
+
+      auto actual = build(top);
+      auto expect = build(top->clone());
+
+      if (actual != expect)
+      {
+        std::cout << "Seed " << seed << ", step " << step << ": expected"
+                  << std::endl
+                  << expect << "got" << std::endl
+                  << actual;
+        failed++;
+        break;
+      }
+
+      if (!check_cache(top, cache))
+      {
+        std::cout << "Seed " << seed << ", step " << step
+                  << ": cached lookup differs" << std::endl;
+        failed++;
+        break;
+      }
+    }
+
+    cache.clear();
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
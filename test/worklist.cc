@@ -0,0 +1,184 @@
+// Copyright Microsoft and Project Verona Contributors.
+// SPDX-License-Identifier: MIT
+
+// Checks that a pass in worklist mode reaches the same fixed point as the
+// same pass with full traversals, on random trees and a confluent set of
+// rules that use sibling windows, children, ancestors, and lifting, and that
+// a pass shared between threads gives each the same result.
+#include <trieste/pass.h>
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+  using namespace trieste;
+
+  inline const auto Block = TokenDef("block");
+  inline const auto Num = TokenDef("num", flag::print);
+  inline const auto Plus = TokenDef("plus");
+  inline const auto Neg = TokenDef("neg");
+  inline const auto Zero = TokenDef("zero");
+  inline const auto Hoist = TokenDef("hoist");
+
+  inline const auto Lhs = TokenDef("lhs");
+  inline const auto Rhs = TokenDef("rhs");
+
+  int value(const Node& node)
+  {
+    return std::stoi(std::string(node->location().view()));
+  }
+
+  Node num(int v)
+  {
+    return Num ^ std::to_string(v);
+  }
+
+  PassDef pass(dir::flag direction)
+  {
+    return {
+      direction,
+      {
+        T(Num)[Lhs] * T(Plus) * T(Num)[Rhs] >>
+          [](Match& _) { return num(value(_(Lhs)) + value(_(Rhs))); },
+
+        T(Neg) << (T(Num)[Rhs] * End) >>
+          [](Match& _) { return num(-value(_(Rhs))); },
+
+        T(Block) << (T(Num)[Rhs] * End) >> [](Match& _) { return _(Rhs); },
+
+        In(Block)++ * T(Zero) >> [](Match&) { return num(0); },
+
+        T(Hoist) << (T(Num)[Rhs] * End) >>
+          [](Match& _) { return Lift << Top << _(Rhs); },
+
+        // Lifted values arrive in an order that depends on the traversal, so
+        // sum them to make the result independent of it.
+        In(Top) * T(Num)[Lhs] * T(Num)[Rhs] >>
+          [](Match& _) { return num(value(_(Lhs)) + value(_(Rhs))); },
+      }};
+  }
+
+  void gen(Node parent, std::mt19937& rand, size_t depth)
+  {
+    auto count = rand() % 6;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      auto kind = rand() % ((depth > 0) ? 7 : 4);
+
+      switch (kind)
+      {
+        case 0:
+        case 1:
+          parent << num(int(rand() % 19) - 9);
+          break;
+
+        case 2:
+          parent << Plus;
+          break;
+
+        case 3:
+          parent << Zero;
+          break;
+
+        case 4:
+        {
+          Node block = Block;
+          gen(block, rand, depth - 1);
+          parent << block;
+          break;
+        }
+
+        default:
+        {
+          Node wrap = (kind == 5) ? Neg : Hoist;
+          Node block = Block;
+          gen(block, rand, depth - 1);
+          parent << (wrap << block);
+          break;
+        }
+      }
+    }
+  }
+
+  std::string run(const Pass& p, uint32_t seed)
+  {
+    std::mt19937 rand(seed);
+    Node top = Top;
+    gen(top, rand, 5);
+
+    auto [ast, count, changes] = p->run(top);
+
+    std::stringstream ss;
+    ss << ast;
+    return ss.str();
+  }
+
+  std::string run(dir::flag direction, uint32_t seed)
+  {
+    return run(Pass(pass(direction)), seed);
+  }
+}
+
+int main()
+{
+  size_t failed = 0;
+
+  for (auto direction : {dir::topdown, dir::bottomup})
+  {
+    for (uint32_t seed = 0; seed < 1000; seed++)
+    {
+      auto expect = run(direction, seed);
+      auto actual = run(direction | dir::worklist, seed);
+
+      if (actual != expect)
+      {
+        std::cout << "Seed " << seed << ", direction " << direction
+                  << ": expected" << std::endl
+                  << expect << "got" << std::endl
+                  << actual;
+        failed++;
+      }
+    }
+  }
+
+  Pass shared = pass(dir::topdown | dir::worklist);
+  std::vector<std::string> results(4);
+  std::vector<std::thread> threads;
+
+  for (uint32_t i = 0; i < results.size(); i++)
+  {
+    threads.emplace_back([&, i] {
+      for (uint32_t seed = i * 100; seed < (i + 1) * 100; seed++)
+        results[i] += run(shared, seed);
+    });
+  }
+
+  for (auto& thread : threads)
+    thread.join();
+
+  for (uint32_t i = 0; i < results.size(); i++)
+  {
+    std::string expect;
+
+    for (uint32_t seed = i * 100; seed < (i + 1) * 100; seed++)
+      expect += run(dir::topdown, seed);
+
+    if (results[i] != expect)
+    {
+      std::cout << "Thread " << i << " got a different result" << std::endl;
+      failed++;
+    }
+  }
+
+  if (failed > 0)
+  {
+    std::cout << failed << " failures" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}